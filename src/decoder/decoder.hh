@@ -234,6 +234,8 @@ public:
 
   size_t hash( void ) const;
 
+  size_t golden_hash( void ) const { return golden_hash_; }
+
   std::string str( void ) const;
 
   bool operator==( const DecoderHash & other ) const;
@@ -30,15 +30,27 @@
 
 #pragma once
 #include <algorithm>
+#include <climits>
 #include <cstdio>
-#include <fstream>
-#include <iterator>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
 #include <string>
+#include <sys/uio.h>
 #include <utility>
 #include <vector>
 
 #include "file.hh"
 #include "file_descriptor.hh"
+#include "raster_handle.hh"
+
+// raster planes start at multiples of this offset into the state file,
+// so they can be copied (or mapped) straight out of it
+static constexpr size_t SERDES_PLANE_ALIGNMENT = 4096;
+
+static inline size_t serdes_plane_padding(const size_t offset) {
+  return (SERDES_PLANE_ALIGNMENT - offset % SERDES_PLANE_ALIGNMENT) % SERDES_PLANE_ALIGNMENT;
+}
 
 enum class EncoderSerDesTag : uint8_t
   { PROB_TABLE
@@ -53,14 +65,46 @@ enum class EncoderSerDesTag : uint8_t
   , REF_GOLD
   , REF_ALT
   , DECODER
+  , FORMAT_VERSION
   };
 
+// every state file starts with FORMAT_VERSION and this, so that files
+// written in another layout are rejected instead of misread
+static constexpr uint8_t SERDES_FORMAT_VERSION = 2;
+static constexpr size_t SERDES_FORMAT_HEADER_SIZE = 2;
+
 class EncoderStateSerializer {
   private:
+    // everything but the raster planes, which are spliced in from the
+    // rasters themselves at each recorded offset into data_
     std::vector<uint8_t> data_ = {};
+    std::vector<std::pair<size_t, RasterHandle>> rasters_ = {};
+    size_t plane_bytes_ = 0;
+
+    size_t file_offset(void) const { return data_.size() + plane_bytes_; }
+
+    static void write_all(const int fd, std::vector<iovec> &iov) {
+      size_t next = 0;
+      while (next < iov.size()) {
+        const int count = std::min<size_t>(iov.size() - next, IOV_MAX);
+        size_t written = SystemCall("writev", writev(fd, &iov[next], count));
+
+        while (next < iov.size() and written >= iov[next].iov_len) {
+          written -= iov[next++].iov_len;
+        }
+
+        if (written > 0) {
+          iov[next].iov_base = static_cast<uint8_t *>(iov[next].iov_base) + written;
+          iov[next].iov_len -= written;
+        }
+      }
+    }
 
   public:
-    EncoderStateSerializer() {}
+    EncoderStateSerializer() {
+      this->put(EncoderSerDesTag::FORMAT_VERSION);
+      this->put(SERDES_FORMAT_VERSION);
+    }
 
     void reserve(size_t n) {
       data_.reserve(data_.size() + n);
@@ -89,33 +133,55 @@ class EncoderStateSerializer {
       return offset;
     }
 
-    size_t put(const VP8Raster &ref, EncoderSerDesTag t) {
-      unsigned width = ref.width();
-      unsigned height = ref.height();
-      uint32_t len = width * height + 2 * (width / 2) * (height / 2);
-      this->reserve(5 + len);
+    // tag, length, zero padding up to an aligned offset, then Y, U and V;
+    // the length counts the padding, and the planes aren't copied until
+    // they're written
+    size_t put(const RasterHandle &ref, EncoderSerDesTag t) {
+      unsigned width = ref.get().width();
+      unsigned height = ref.get().height();
+      uint32_t planes_len = width * height + 2 * (width / 2) * (height / 2);
+      uint32_t padding = serdes_plane_padding(file_offset() + 5);
+      this->reserve(5 + padding);
       this->put(t);
-      this->put(len);
+      this->put(padding + planes_len);
+      data_.resize(data_.size() + padding, 0);
+
+      rasters_.emplace_back(data_.size(), ref);
+      plane_bytes_ += planes_len;
 
-      ref.Y().forall([this](uint8_t &f){ this->put(f); });
-      ref.U().forall([this](uint8_t &f){ this->put(f); });
-      ref.V().forall([this](uint8_t &f){ this->put(f); });
+      return padding + planes_len + 5;
+    }
+
+    void write(const int fd) const {
+      std::vector<iovec> iov;
+      uint8_t *data = const_cast<uint8_t *>(data_.data());
+      size_t offset = 0;
+
+      for (const auto &raster : rasters_) {
+        iov.push_back({data + offset, raster.first - offset});
+        offset = raster.first;
 
-      return len + 5;
+        for (const TwoD<uint8_t> *plane : {&raster.second.get().Y(), &raster.second.get().U(), &raster.second.get().V()}) {
+          iov.push_back({const_cast<uint8_t *>(&plane->at(0, 0)), plane->width() * plane->height()});
+        }
+      }
+
+      iov.push_back({data + offset, data_.size() - offset});
+      write_all(fd, iov);
     }
 
-    void write(const char *filename) {
-      std::ofstream output_file(filename);
-      std::ostream_iterator<uint8_t> output_iter(output_file);
-      std::copy(data_.begin(), data_.end(), output_iter);
+    void write(const char *filename) const {
+      FileDescriptor output(SystemCall(filename, open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)));
+      this->write(output.fd_num());
     }
 
-    void write(const std::string &filename) {
+    void write(const std::string &filename) const {
       this->write(filename.c_str());
     }
 
-    void write(FILE *file) {
-      std::fwrite(data_.data(), 1, data_.size(), file);
+    void write(FILE *file) const {
+      std::fflush(file);
+      this->write(fileno(file));
     }
 };
 
@@ -126,22 +192,30 @@ class EncoderStateDeserializer : File {
   public:
     EncoderStateDeserializer(const char *filename)
       : File(filename)
-      , ptr_(0) {}
+      , ptr_(0) { check_format(); }
 
     EncoderStateDeserializer(const std::string &filename)
       : File(filename.c_str())
-      , ptr_(0) {}
+      , ptr_(0) { check_format(); }
 
     EncoderStateDeserializer(FILE *file)
       : File(std::move(FileDescriptor(file)))
-      , ptr_(0) {}
+      , ptr_(0) { check_format(); }
 
     template<typename T, typename F, typename ...Ps> static T build(F f, Ps ...ps) {
       EncoderStateDeserializer idata(f);
       return T::deserialize(idata, std::forward<Ps>(ps)...);
     }
 
-    void reset(void) { ptr_ = 0; }
+    void check_format(void) {
+      if (size() < SERDES_FORMAT_HEADER_SIZE
+          or get_tag() != EncoderSerDesTag::FORMAT_VERSION
+          or get<uint8_t>() != SERDES_FORMAT_VERSION) {
+        throw std::runtime_error("unsupported encoder state format");
+      }
+    }
+
+    void reset(void) { ptr_ = SERDES_FORMAT_HEADER_SIZE; }
     size_t remaining(void) const { return chunk().size() - ptr_; }
     size_t size(void) const { return chunk().size(); }
 
@@ -174,15 +248,20 @@ class EncoderStateDeserializer : File {
         unsigned rwidth = raster.get().width();
         unsigned rheight = raster.get().height();
 
-        uint32_t expect_len = rwidth * rheight + 2 * (rwidth / 2) * (rheight / 2);
         uint32_t get_len = this->get<uint32_t>();
-        assert(get_len == expect_len);
-        (void) get_len;     // only used in assert
-        (void) expect_len;  // only used in assert
-
-        raster.get().Y().forall([this](uint8_t &f){ f = this->get<uint8_t>(); });
-        raster.get().U().forall([this](uint8_t &f){ f = this->get<uint8_t>(); });
-        raster.get().V().forall([this](uint8_t &f){ f = this->get<uint8_t>(); });
+        size_t padding = serdes_plane_padding(ptr_);
+        uint32_t expect_len = rwidth * rheight + 2 * (rwidth / 2) * (rheight / 2);
+        if (get_len != padding + expect_len or get_len > remaining()) {
+          throw std::runtime_error("serialized raster does not match its dimensions");
+        }
+        ptr_ += padding;
+
+        // the planes are contiguous in the file and in the raster
+        for (TwoD<uint8_t> *plane : {&raster.get().Y(), &raster.get().U(), &raster.get().V()}) {
+          const size_t plane_len = plane->width() * plane->height();
+          memcpy(&plane->at(0, 0), chunk().buffer() + ptr_, plane_len);
+          ptr_ += plane_len;
+        }
       }
 
       return raster;
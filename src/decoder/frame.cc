@@ -26,6 +26,8 @@
    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+#include <algorithm>
+
 #include "frame.hh"
 
 using namespace std;
@@ -136,35 +138,48 @@ void Frame<FrameHeaderType, MacroblockType>::parse_tokens( vector< Chunk > dct_p
                                                                   probability_tables ); } );
 }
 
+template <class FrameHeaderType, class MacroblockType>
+FilterParameters Frame<FrameHeaderType, MacroblockType>::macroblock_filter_parameters( const Optional< Segmentation > & segmentation,
+                                                                                       const MacroblockType & macroblock ) const
+{
+  FilterParameters filter( header_.filter_type,
+                           header_.loop_filter_level,
+                           header_.sharpness_level );
+
+  /* per-segment filter adjustments, if segmentation is enabled */
+  if ( segmentation.initialized() ) {
+    filter.filter_level = segmentation.get().segment_filter_adjustments.at( macroblock.segment_id() )
+      + ( segmentation.get().absolute_segment_adjustments
+          ? 0
+          : filter.filter_level );
+  }
+
+  return filter;
+}
+
+template <class FrameHeaderType, class MacroblockType>
+void Frame<FrameHeaderType, MacroblockType>::loopfilter_macroblock( const Optional< Segmentation > & segmentation,
+                                                                    const Optional< FilterAdjustments > & filter_adjustments,
+                                                                    const unsigned int column,
+                                                                    const unsigned int row,
+                                                                    VP8Raster & raster ) const
+{
+  if ( header_.loop_filter_level ) {
+    const MacroblockType & macroblock = macroblock_headers_.get().at( column, row );
+    VP8Raster::Macroblock output = raster.macroblock( column, row );
+
+    macroblock.loopfilter( filter_adjustments,
+                           macroblock_filter_parameters( segmentation, macroblock ),
+                           output );
+  }
+}
+
 template <class FrameHeaderType, class MacroblockType>
 void Frame<FrameHeaderType, MacroblockType>::loopfilter( const Optional< Segmentation > & segmentation,
                                                          const Optional< FilterAdjustments > & filter_adjustments,
                                                          VP8Raster & raster ) const
 {
   if ( header_.loop_filter_level ) {
-    /* calculate per-segment filter adjustments if
-       segmentation is enabled */
-
-    const FilterParameters frame_loopfilter( header_.filter_type,
-                                             header_.loop_filter_level,
-                                             header_.sharpness_level );
-
-    SafeArray< FilterParameters, num_segments > segment_loopfilters;
-
-    if ( segmentation.initialized() ) {
-      for ( uint8_t i = 0; i < num_segments; i++ ) {
-        FilterParameters segment_filter( header_.filter_type,
-                                         header_.loop_filter_level,
-                                         header_.sharpness_level );
-        segment_filter.filter_level = segmentation.get().segment_filter_adjustments.at( i )
-          + ( segmentation.get().absolute_segment_adjustments
-              ? 0
-              : segment_filter.filter_level );
-
-        segment_loopfilters.at( i ) = segment_filter;
-      }
-    }
-
     /* the macroblock needs to know whether the mode- and reference-based
        filter adjustments are enabled */
 
@@ -174,9 +189,8 @@ void Frame<FrameHeaderType, MacroblockType>::loopfilter( const Optional< Segment
                                          {
                                            VP8Raster::Macroblock output = raster.macroblock( column, row );
                                            macroblock.loopfilter( filter_adjustments,
-                                                                  segmentation.initialized()
-                                                                  ? segment_loopfilters.at( macroblock.segment_id() )
-                                                                  : frame_loopfilter,
+                                                                  macroblock_filter_parameters( segmentation,
+                                                                                                macroblock ),
                                                                   output ); } );
   }
 }
@@ -193,10 +207,13 @@ SafeArray<Quantizer, num_segments> Frame<FrameHeaderType, MacroblockType>::calcu
   if ( segmentation.initialized() ) {
     for ( uint8_t i = 0; i < num_segments; i++ ) {
       QuantIndices segment_indices( header_.quant_indices );
-      segment_indices.y_ac_qi = segmentation.get().segment_quantizer_adjustments.at( i )
+      const int y_ac_qi = segmentation.get().segment_quantizer_adjustments.at( i )
         + ( segmentation.get().absolute_segment_adjustments
-            ? static_cast<Unsigned<7>>( 0 )
-            : segment_indices.y_ac_qi );
+            ? 0
+            : static_cast<int>( segment_indices.y_ac_qi ) );
+
+      /* a relative adjustment can take the index out of range */
+      segment_indices.y_ac_qi = max( 0, min( 127, y_ac_qi ) );
 
       segment_quantizers.at( i ) = Quantizer( segment_indices );
     }
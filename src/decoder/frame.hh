@@ -65,6 +65,9 @@ class Frame
   ProbabilityArray< num_segments > calculate_mb_segment_tree_probs( void ) const;
   SafeArray< Quantizer, num_segments > calculate_segment_quantizers( const Optional< Segmentation > & segmentation ) const;
 
+  FilterParameters macroblock_filter_parameters( const Optional< Segmentation > & segmentation,
+                                                 const MacroblockType & macroblock ) const;
+
   std::vector< uint8_t > serialize_first_partition( const ProbabilityTables & probability_tables ) const;
   std::vector< std::vector< uint8_t > > serialize_tokens( const ProbabilityTables & probability_tables ) const;
 
@@ -74,6 +77,13 @@ class Frame
                    const Optional< FilterAdjustments > & quantizer_filter_adjustments,
                    VP8Raster & target ) const;
 
+  /* filters a single macroblock (its neighbors above and to the left have to
+     be in place in target, as the filter reaches into them) */
+  void loopfilter_macroblock( const Optional< Segmentation > & segmentation,
+                              const Optional< FilterAdjustments > & quantizer_filter_adjustments,
+                              const unsigned int column, const unsigned int row,
+                              VP8Raster & target ) const;
+
   Frame( const bool show,
          const unsigned int width,
          const unsigned int height,
@@ -2,11 +2,63 @@
 
 #include <algorithm>
 #include <cmath>
+#include <mutex>
+#include <unordered_map>
+#include <boost/functional/hash.hpp>
 
 #include "costs.hh"
 
 using namespace std;
 
+/* The token and motion vector cost tables depend only on the probabilities
+   they are computed from, which rarely change between frames (and are often
+   identical across the encoders Salsify keeps around). The computed tables
+   are kept in a small process-wide cache shared by every Encoder. */
+template<class Probabilities, class Table>
+class CostTableCache
+{
+private:
+  static constexpr size_t capacity = 32;
+
+  mutex mutex_ {};
+  unordered_multimap<size_t, pair<Probabilities, Table>> tables_ {};
+
+  static size_t hash( const Probabilities & probabilities )
+  {
+    /* nested SafeArrays of Probability are plain bytes */
+    const uint8_t * data = reinterpret_cast<const uint8_t *>( &probabilities );
+    return boost::hash_range( data, data + sizeof( Probabilities ) );
+  }
+
+public:
+  bool lookup( const Probabilities & probabilities, Table & table )
+  {
+    lock_guard<mutex> lock { mutex_ };
+    auto range = tables_.equal_range( hash( probabilities ) );
+
+    for ( auto it = range.first; it != range.second; it++ ) {
+      if ( it->second.first == probabilities ) {
+        table = it->second.second;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void insert( const Probabilities & probabilities, const Table & table )
+  {
+    const size_t key = hash( probabilities );
+    lock_guard<mutex> lock { mutex_ };
+
+    if ( tables_.size() >= capacity ) {
+      tables_.clear();
+    }
+
+    tables_.emplace( key, make_pair( probabilities, table ) );
+  }
+};
+
 /*
  * This file is based on
  * [1] libvpx:vp8/encoder/rdopt.c
@@ -114,6 +166,13 @@ void Costs::fill_mv_component_costs( const SafeArray<SafeArray<Probability, MV_P
 {
   enum { IS_SHORT, SIGN, SHORT, BITS = SHORT + 8 - 1, LONG_MV_WIDTH = 10 };
 
+  static CostTableCache<SafeArray<SafeArray<Probability, MV_PROB_CNT>, 2>,
+                        decltype( mv_component_costs )> cache;
+
+  if ( cache.lookup( motion_vector_probs, mv_component_costs ) ) {
+    return;
+  }
+
   mv_component_costs.at( 0 ).at( 0 ).at( 0 ) = mv_component_costs.at( 0 ).at( 1 ).at( 0 )
                                              = mv_component_cost( 0, motion_vector_probs.at( 0 ) );
   mv_component_costs.at( 1 ).at( 0 ).at( 0 ) = mv_component_costs.at( 1 ).at( 1 ).at( 0 )
@@ -129,23 +188,35 @@ void Costs::fill_mv_component_costs( const SafeArray<SafeArray<Probability, MV_P
     mv_component_costs.at( 1 ).at( 0 ).at( i ) = cost_1 + cost_zero( motion_vector_probs.at( 1 ).at( SIGN ) );
     mv_component_costs.at( 1 ).at( 1 ).at( i ) = cost_1 +  cost_one( motion_vector_probs.at( 1 ).at( SIGN ) );
   }
+
+  cache.insert( motion_vector_probs, mv_component_costs );
 }
 
 // libvpx:vp8/encoder/onyx_if.c:1698
 void Costs::fill_mv_sad_costs()
 {
-  mv_sad_costs.at( 0 ).at( 0 ).at( 0 ) = 300;
-  mv_sad_costs.at( 0 ).at( 1 ).at( 0 ) = 300;
-  mv_sad_costs.at( 1 ).at( 0 ).at( 0 ) = 300;
-  mv_sad_costs.at( 1 ).at( 1 ).at( 0 ) = 300;
-
-  for ( size_t i = 1; i <= 255; i++ ) {
-    size_t cost = 256 * ( 2 * log2f( 8 * i ) + 0.6 );
-    mv_sad_costs.at( 0 ).at( 0 ).at( i ) = cost;
-    mv_sad_costs.at( 0 ).at( 1 ).at( i ) = cost;
-    mv_sad_costs.at( 1 ).at( 0 ).at( i ) = cost;
-    mv_sad_costs.at( 1 ).at( 1 ).at( i ) = cost;
-  }
+  /* these don't depend on the probabilities, so they're computed only once */
+  static const decltype( mv_sad_costs ) sad_costs = [] ()
+    {
+      decltype( mv_sad_costs ) costs;
+
+      costs.at( 0 ).at( 0 ).at( 0 ) = 300;
+      costs.at( 0 ).at( 1 ).at( 0 ) = 300;
+      costs.at( 1 ).at( 0 ).at( 0 ) = 300;
+      costs.at( 1 ).at( 1 ).at( 0 ) = 300;
+
+      for ( size_t i = 1; i <= 255; i++ ) {
+        size_t cost = 256 * ( 2 * log2f( 8 * i ) + 0.6 );
+        costs.at( 0 ).at( 0 ).at( i ) = cost;
+        costs.at( 0 ).at( 1 ).at( i ) = cost;
+        costs.at( 1 ).at( 0 ).at( i ) = cost;
+        costs.at( 1 ).at( 1 ).at( i ) = cost;
+      }
+
+      return costs;
+    }();
+
+  mv_sad_costs = sad_costs;
 }
 
 template<unsigned int array_size, unsigned int prob_nodes, unsigned int token_count>
@@ -171,6 +242,13 @@ void Costs::compute_cost( SafeArray<uint16_t, array_size> & costs_nodes,
 
 void Costs::fill_token_costs( const ProbabilityTables & probability_tables )
 {
+  static CostTableCache<decltype( probability_tables.coeff_probs ),
+                        decltype( token_costs )> cache;
+
+  if ( cache.lookup( probability_tables.coeff_probs, token_costs ) ) {
+    return;
+  }
+
   for ( size_t i = 0; i < BLOCK_TYPES; i++ ) {
     for ( size_t j = 0; j < COEF_BANDS; j++ ) {
       for ( size_t k = 0; k < PREV_COEF_CONTEXTS; k++ ) {
@@ -186,6 +264,8 @@ void Costs::fill_token_costs( const ProbabilityTables & probability_tables )
       }
     }
   }
+
+  cache.insert( probability_tables.coeff_probs, token_costs );
 }
 
 void Costs::fill_mode_costs()
@@ -205,6 +285,30 @@ void Costs::fill_mode_costs()
   // fill intra_uv_mode_costs
   compute_cost( intra_uv_mode_costs.at( 0 ), kf_uv_mode_probs, uv_mode_tree );
   compute_cost( intra_uv_mode_costs.at( 1 ), k_default_uv_mode_probs, uv_mode_tree );
+
+  // fill submv_ref_costs and split_mv_costs
+  for ( size_t i = 0; i < submv_ref_probs2.size(); i++ ) {
+    compute_cost( submv_ref_costs.at( i ), submv_ref_probs2.at( i ), submv_ref_tree );
+  }
+
+  compute_cost( split_mv_costs, split_mv_probs, split_mv_tree );
+
+  fill_reference_costs( 128, 128, 128 );
+}
+
+/*
+ * Fill the cost of signaling the reference frame of a macroblock, with the
+ * probabilities from the frame header.
+ */
+void Costs::fill_reference_costs( const uint8_t prob_inter, const uint8_t prob_last,
+                                  const uint8_t prob_golden )
+{
+  reference_costs.at( CURRENT_FRAME ) = cost_zero( prob_inter );
+  reference_costs.at( LAST_FRAME ) = cost_one( prob_inter ) + cost_zero( prob_last );
+  reference_costs.at( GOLDEN_FRAME ) = cost_one( prob_inter ) + cost_one( prob_last )
+                                       + cost_zero( prob_golden );
+  reference_costs.at( ALTREF_FRAME ) = cost_one( prob_inter ) + cost_one( prob_last )
+                                       + cost_one( prob_golden );
 }
 
 /*
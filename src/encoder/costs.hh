@@ -51,12 +51,23 @@ public:
 
   SafeArray<SafeArray<uint16_t, num_uv_modes>, 2> intra_uv_mode_costs;
 
+  /* submv_ref_costs[a][b]:
+   * a is the context of the subblock (see YBlock::write_subblock_inter_prediction),
+   * b is the subblock mode (LEFT4X4 to NEW4X4).
+   */
+  SafeArray<SafeArray<uint16_t, num_intra_b_modes + num_inter_b_modes>, 5> submv_ref_costs;
+  SafeArray<uint16_t, 4> split_mv_costs;
+
+  SafeArray<uint16_t, num_reference_frames> reference_costs;
+
   void fill_token_costs( const ProbabilityTables & probability_tables );
 
   void fill_mode_costs();
   void fill_mv_ref_costs( const ProbabilityArray< num_mv_refs > & mv_ref_probs );
   void fill_mv_component_costs( const SafeArray<SafeArray<Probability, MV_PROB_CNT>, 2> & motion_vector_probs );
   void fill_mv_sad_costs();
+  void fill_reference_costs( const uint8_t prob_inter, const uint8_t prob_last,
+                             const uint8_t prob_golden );
 
   uint32_t motion_vector_cost( const MotionVector & mv, size_t weight ) const;
   uint32_t sad_motion_vector_cost( const MotionVector & mv,
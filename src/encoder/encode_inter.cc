@@ -28,6 +28,7 @@
 
 #include <limits>
 
+#include "decoder_state.hh"
 #include "encoder.hh"
 #include "scorer.hh"
 
@@ -167,6 +168,18 @@ void Encoder::update_decoder_state( const InterFrame & frame )
   } else {
     decoder_state_.filter_adjustments.clear();
   }
+
+  if ( frame.header().update_segmentation.initialized() ) {
+    if ( decoder_state_.segmentation.initialized() ) {
+      decoder_state_.segmentation.get().update( frame.header() );
+    } else {
+      decoder_state_.segmentation.initialize( frame.header(), width(), height() );
+    }
+  } else {
+    decoder_state_.segmentation.clear();
+  }
+
+  update_segmentation_map( frame );
 }
 
 Encoder::MVSearchResult Encoder::diamond_search( const VP8Raster::Macroblock & original_mb,
@@ -228,6 +241,176 @@ Encoder::MVSearchResult Encoder::diamond_search( const VP8Raster::Macroblock & o
   return { origin, first_step };
 }
 
+/* The context for the submv_ref tree, as in YBlock::write_subblock_inter_prediction */
+static uint8_t submv_ref_context( const MotionVector & left_mv, const MotionVector & above_mv )
+{
+  if ( left_mv == above_mv ) {
+    return left_mv.empty() ? 4 : 3;
+  }
+
+  if ( above_mv.empty() ) {
+    return 2;
+  }
+
+  return left_mv.empty() ? 1 : 0;
+}
+
+/*
+ * Searches the SPLITMV partitionings of the macroblock against the given
+ * reference. The subblock motion vectors of frame_mb are used as scratch
+ * space, so that the LEFT4X4 and ABOVE4X4 candidates of each partition see
+ * the choices made for the partitions before it, as the decoder does.
+ */
+Encoder::SplitMVSearchResult Encoder::luma_mb_split_predict( const VP8Raster::Macroblock & original_mb,
+                                                             VP8Raster::Macroblock & temp_mb,
+                                                             InterFrameMacroblock & frame_mb,
+                                                             const VP8Raster & reference,
+                                                             const MotionVector & best_ref,
+                                                             const MotionVector & start_mv ) const
+{
+  const auto reference_mb = reference.macroblock( original_mb.Y.column(),
+                                                  original_mb.Y.row() );
+
+  const uint8_t last_partition_id = ( inter_search_effort_ >= FULL_SPLITMV_SEARCH ) ? 3 : 2;
+
+  /* sub-motion vectors that would have to be clamped by the decoder are not
+     considered */
+  auto in_bounds = [&]( const MotionVector & mv )
+    {
+      return Scorer::clamp( mv, frame_mb.context() ) == mv
+             and not out_of_bounds( mv - best_ref );
+    };
+
+  SplitMVSearchResult best_split;
+
+  for ( uint8_t partition_id = 0; partition_id <= last_partition_id; partition_id++ ) {
+    SplitMVSearchResult split;
+    split.partition_id = partition_id;
+    split.pred.prediction_mode = SPLITMV;
+    split.pred.rate = costs_.mbmode_costs.at( 1 ).at( SPLITMV )
+                      + costs_.split_mv_costs.at( partition_id );
+    split.pred.distortion = 0;
+
+    for ( const auto & partition : mv_partitions.at( partition_id ) ) {
+      const YBlock & first_subblock = frame_mb.Y().at( partition.front().first,
+                                                       partition.front().second );
+
+      const MotionVector left_mv = first_subblock.context().left.initialized()
+        ? first_subblock.context().left.get()->motion_vector() : MotionVector();
+      const MotionVector above_mv = first_subblock.context().above.initialized()
+        ? first_subblock.context().above.get()->motion_vector() : MotionVector();
+
+      const auto & mode_costs = costs_.submv_ref_costs.at( submv_ref_context( left_mv, above_mv ) );
+
+      auto partition_distortion = [&]( const MotionVector & mv )
+        {
+          uint32_t distortion = 0;
+
+          for ( const auto & subblock : partition ) {
+            auto & prediction = temp_mb.Y_sub_at( subblock.first, subblock.second ).mutable_contents();
+            const auto & original_sb = original_mb.Y_sub_at( subblock.first, subblock.second );
+
+            reference_mb.Y_sub_at( subblock.first, subblock.second ).inter_predict( mv, reference.Y(),
+                                                                                  prediction );
+
+            distortion += ( distortion_metric_ == SATD_DISTORTION )
+                          ? satd_distortion( original_sb, prediction )
+                          : sse( original_sb, prediction );
+          }
+
+          return distortion;
+        };
+
+      MBPredictionData best_sub_pred;
+      bmode best_sub_mode = ZERO4X4;
+
+      auto try_candidate = [&]( const bmode mode, const MotionVector & mv, const uint32_t mv_rate )
+        {
+          MBPredictionData sub_pred;
+          sub_pred.mv = mv;
+          sub_pred.rate = mode_costs.at( mode ) + mv_rate;
+          sub_pred.distortion = partition_distortion( mv );
+          sub_pred.cost = rdcost( sub_pred.rate, sub_pred.distortion,
+                                  RATE_MULTIPLIER, DISTORTION_MULTIPLIER );
+
+          if ( sub_pred.cost < best_sub_pred.cost ) {
+            best_sub_pred = sub_pred;
+            best_sub_mode = mode;
+          }
+
+          return sub_pred.cost;
+        };
+
+      try_candidate( ZERO4X4, MotionVector(), 0 );
+
+      if ( not left_mv.empty() and in_bounds( left_mv ) ) {
+        try_candidate( LEFT4X4, left_mv, 0 );
+      }
+
+      if ( not above_mv.empty() and not ( above_mv == left_mv ) and in_bounds( above_mv ) ) {
+        try_candidate( ABOVE4X4, above_mv, 0 );
+      }
+
+      /* a small diamond search for NEW4X4, around the best whole-macroblock
+         motion vector */
+      MotionVector new_mv = Scorer::clamp( start_mv, frame_mb.context() );
+
+      if ( in_bounds( new_mv ) ) {
+        uint32_t new_cost = try_candidate( NEW4X4, new_mv,
+                                           costs_.motion_vector_cost( new_mv - best_ref, 96 ) );
+
+        /* motion vectors are in 1/8 pixel units, but only quarter-pixel
+           positions can be coded */
+        for ( int16_t step = 16; step > 1; ) {
+          MotionVector best_step_mv = new_mv;
+
+          for ( const auto & direction : { MotionVector( step, 0 ), MotionVector( -step, 0 ),
+                                           MotionVector( 0, step ), MotionVector( 0, -step ) } ) {
+            const MotionVector candidate_mv = new_mv + direction;
+
+            if ( not in_bounds( candidate_mv ) ) continue;
+
+            const uint32_t cost = try_candidate( NEW4X4, candidate_mv,
+                                                 costs_.motion_vector_cost( candidate_mv - best_ref, 96 ) );
+
+            if ( cost < new_cost ) {
+              new_cost = cost;
+              best_step_mv = candidate_mv;
+            }
+          }
+
+          if ( best_step_mv == new_mv ) {
+            step /= 2;
+          }
+          else {
+            new_mv = best_step_mv;
+          }
+        }
+      }
+
+      for ( const auto & subblock : partition ) {
+        const size_t index = subblock.first + 4 * subblock.second;
+        split.modes.at( index ) = best_sub_mode;
+        split.mvs.at( index ) = best_sub_pred.mv;
+
+        frame_mb.Y().at( subblock.first, subblock.second ).set_motion_vector( best_sub_pred.mv );
+      }
+
+      split.pred.rate += best_sub_pred.rate;
+      split.pred.distortion += best_sub_pred.distortion;
+    }
+
+    split.pred.cost = rdcost( split.pred.rate, split.pred.distortion,
+                              RATE_MULTIPLIER, DISTORTION_MULTIPLIER );
+
+    if ( split.pred.cost < best_split.pred.cost ) {
+      best_split = split;
+    }
+  }
+
+  return best_split;
+}
+
 void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
                                      VP8Raster::Macroblock & reconstructed_mb,
                                      VP8Raster::Macroblock & temp_mb,
@@ -235,24 +418,42 @@ void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
                                      const Quantizer & quantizer,
                                      MVComponentCounts & /* component_counts */,
                                      const size_t y_ac_qi,
-                                     const EncoderPass encoder_pass )
+                                     const EncoderPass encoder_pass,
+                                     const bool intra_only )
 {
   MBPredictionData best_pred;
 
   best_pred = luma_mb_best_prediction_mode( original_mb, reconstructed_mb, temp_mb,
                                             frame_mb, quantizer, encoder_pass, true );
 
-  reference_frame frame_ref = LAST_FRAME;
+  /* the references worth searching: GOLDEN_FRAME and ALTREF_FRAME are skipped
+     when they are identical to a reference that is already searched */
+  vector<reference_frame> search_references { LAST_FRAME };
 
-  frame_mb.mutable_header().is_inter_mb = true;
-  frame_mb.mutable_header().set_reference( frame_ref );
+  if ( intra_only ) {
+    search_references.clear();
+  }
+  else {
+    /* with three temporal layers, GOLDEN_FRAME holds the middle layer,
+       which only the top layer may (and always should) predict from */
+    const bool search_golden = ( temporal_layers_ == 3 )
+                               ? ( temporal_layer() == 2 )
+                               : ( inter_search_effort_ >= ALL_REFERENCES_SEARCH );
+
+    if ( search_golden and references_.golden != references_.last ) {
+      search_references.push_back( GOLDEN_FRAME );
+    }
 
-  MotionVector best_mv;
-  const VP8Raster & reference = references_.at( frame_ref );
-  const SafeRaster & safe_reference = safe_references_.get( frame_ref );
+    if ( inter_search_effort_ >= ALL_REFERENCES_SEARCH
+         and references_.alternative != references_.last
+         and references_.alternative != references_.golden ) {
+      search_references.push_back( ALTREF_FRAME );
+    }
+  }
 
-  const auto reference_mb = reference.macroblock( original_mb.Y.column(),
-                                                  original_mb.Y.row() );
+  reference_frame frame_ref = LAST_FRAME;
+
+  MotionVector best_mv;
 
   TwoDSubRange<uint8_t, 16, 16> & prediction = temp_mb.Y.mutable_contents();
 
@@ -266,87 +467,135 @@ void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
 
   costs_.fill_mv_ref_costs( mv_ref_probs );
 
-  constexpr array<mbmode, 4> inter_modes = { ZEROMV, NEARESTMV, NEARMV, NEWMV, /* SPLIMV */ };
+  constexpr array<mbmode, 4> inter_modes = { ZEROMV, NEARESTMV, NEARMV, NEWMV };
+
+  for ( const reference_frame reference_id : search_references ) {
+    const VP8Raster & reference = references_.at( reference_id );
+    const SafeRaster & safe_reference = safe_references_.get( reference_id );
+
+    const auto reference_mb = reference.macroblock( original_mb.Y.column(),
+                                                    original_mb.Y.row() );
+
+    /* the cost of signaling the reference is only taken into account when
+       there is a choice to be made */
+    const uint32_t reference_rate = ( search_references.size() > 1 )
+                                    ? costs_.reference_costs.at( reference_id ) : 0;
+
+    for ( const mbmode prediction_mode : inter_modes ) {
+      MBPredictionData pred;
+      pred.prediction_mode = prediction_mode;
+      MotionVector mv;
+
+      switch ( prediction_mode ) {
+      case NEWMV:
+        /* In the case of REALTIME_QUALITY, we should limit the number of times
+         * that we search for a new motion vector.
+         */
+        if ( encode_quality_ == REALTIME_QUALITY ) {
+          if ( not ( frame_mb.context().column % 4 == 0 and frame_mb.context().row % 4 == 0 ) ) {
+            continue;
+          }
+        }
 
-  for ( const mbmode prediction_mode : inter_modes ) {
-    MBPredictionData pred;
-    pred.prediction_mode = prediction_mode;
-    MotionVector mv;
-
-    switch ( prediction_mode ) {
-    case NEWMV:
-      /* In the case of REALTIME_QUALITY, we should limit the number of times
-       * that we search for a new motion vector.
-       */
-      if ( encode_quality_ == REALTIME_QUALITY ) {
-        if ( not ( frame_mb.context().column % 4 == 0 and frame_mb.context().row % 4 == 0 ) ) {
+        for ( int step = 512; step > 1; ) {
+          MVSearchResult result = diamond_search( original_mb, temp_mb, frame_mb,
+                                                  reference, safe_reference,
+                                                  best_ref, mv, step, y_ac_qi );
+
+          if ( result.mv == mv ) {
+            break; // there's no need to continue the search
+          }
+
+          mv = result.mv;
+          step = result.first_step;
+        }
+
+        mv += best_ref;
+
+        if ( mv.empty() ) {
           continue;
         }
-      }
 
-      for ( int step = 512; step > 1; ) {
-        MVSearchResult result = diamond_search( original_mb, temp_mb, frame_mb,
-                                                reference, safe_reference,
-                                                best_ref, mv, step, y_ac_qi );
+        break;
 
-        if ( result.mv == mv ) {
-          break; // there's no need to continue the search
+      case NEARESTMV:
+      case NEARMV:
+        mv = Scorer::clamp( ( prediction_mode == NEARMV ) ? census.near() : census.nearest(),
+                            frame_mb.context() );
+
+        if ( mv.empty() ) {
+          // Same as ZEROMV
+          continue;
         }
 
-        mv = result.mv;
-        step = result.first_step;
-      }
+        break;
 
-      mv += best_ref;
+      case ZEROMV:
+        mv = MotionVector();
+        break;
 
-      if ( mv.empty() ) {
-        continue;
+      default:
+        throw runtime_error( "not supported" );
       }
 
-      break;
+      reference_mb.macroblock().Y.inter_predict( mv, safe_reference, prediction );
 
-    case NEARESTMV:
-    case NEARMV:
-      mv = Scorer::clamp( ( prediction_mode == NEARMV ) ? census.near() : census.nearest(),
-                          frame_mb.context() );
+      pred.distortion = ( distortion_metric_ == SATD_DISTORTION )
+                        ? satd_distortion( original_mb.Y, prediction )
+                        : variance( original_mb.Y, prediction );
+      pred.rate = costs_.mbmode_costs.at( 1 ).at( prediction_mode ) + reference_rate;
 
-      if ( mv.empty() ) {
-        // Same as ZEROMV
-        continue;
+      if ( prediction_mode == NEWMV ) {
+        pred.rate += costs_.motion_vector_cost( mv - best_ref, 96 );
       }
 
-      break;
+      /* chroma_mb_inter_predict( original_mb, reconstructed_mb, temp_mb, frame_mb,
+                               quantizer, encoder_pass );
 
-    case ZEROMV:
-      mv = MotionVector();
-      break;
+      pred.distortion += sse( original_mb.U, reconstructed_mb.U.contents() );
+      pred.distortion += sse( original_mb.V, reconstructed_mb.V.contents() ); */
 
-    default:
-      throw runtime_error( "not supported" );
+      pred.cost = rdcost( pred.rate, pred.distortion, RATE_MULTIPLIER,
+                          DISTORTION_MULTIPLIER );
+
+      if ( pred.cost < best_pred.cost ) {
+        best_mv = mv;
+        best_pred = pred;
+        frame_ref = reference_id;
+        reconstructed_mb.Y.mutable_contents().copy_from( prediction );
+      }
     }
+  }
 
-    reference_mb.macroblock().Y.inter_predict( mv, safe_reference, prediction );
+  /* SPLITMV is only tried against the best reference, if a whole-macroblock
+     inter prediction has won over the intra modes */
+  if ( inter_search_effort_ >= SPLITMV_SEARCH and best_pred.prediction_mode > B_PRED ) {
+    const VP8Raster & reference = references_.at( frame_ref );
 
-    pred.distortion = variance( original_mb.Y, prediction );
-    pred.rate = costs_.mbmode_costs.at( 1 ).at( prediction_mode );
+    SplitMVSearchResult split = luma_mb_split_predict( original_mb, temp_mb, frame_mb,
+                                                       reference, best_ref, best_mv );
 
-    if ( prediction_mode == NEWMV ) {
-      pred.rate += costs_.motion_vector_cost( mv - best_ref, 96 );
-    }
+    if ( split.pred.cost < best_pred.cost ) {
+      best_pred = split.pred;
+      best_mv = split.mvs.at( 15 );
 
-    /* chroma_mb_inter_predict( original_mb, reconstructed_mb, temp_mb, frame_mb,
-                             quantizer, encoder_pass );
+      const auto reference_mb = reference.macroblock( original_mb.Y.column(),
+                                                      original_mb.Y.row() );
 
-    pred.distortion += sse( original_mb.U, reconstructed_mb.U.contents() );
-    pred.distortion += sse( original_mb.V, reconstructed_mb.V.contents() ); */
+      frame_mb.mutable_header().partition_id.initialize( split.partition_id );
 
-    pred.cost = rdcost( pred.rate, pred.distortion, RATE_MULTIPLIER,
-                        DISTORTION_MULTIPLIER );
+      frame_mb.Y().forall_ij(
+        [&] ( YBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
+        {
+          const size_t index = sb_column + 4 * sb_row;
 
-    if ( pred.cost < best_pred.cost ) {
-      best_mv = mv;
-      best_pred = pred;
-      reconstructed_mb.Y.mutable_contents().copy_from( prediction );
+          frame_sb.set_prediction_mode( split.modes.at( index ) );
+          frame_sb.set_motion_vector( split.mvs.at( index ) );
+
+          reference_mb.Y_sub_at( sb_column, sb_row ).inter_predict( split.mvs.at( index ), reference.Y(),
+            reconstructed_mb.Y_sub_at( sb_column, sb_row ).mutable_contents() );
+        }
+      );
     }
   }
 
@@ -354,6 +603,10 @@ void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
     frame_mb.mutable_header().is_inter_mb = false;
     frame_mb.mutable_header().set_reference( CURRENT_FRAME );
 
+    /* the decoder takes the motion vectors of intra macroblocks to be zero
+       when they are the neighbors of SPLITMV subblocks */
+    frame_mb.Y().forall( [&] ( YBlock & frame_sb ) { frame_sb.set_motion_vector( MotionVector() ); } );
+
     luma_mb_apply_intra_prediction( original_mb, reconstructed_mb, temp_mb,
                                     frame_mb, quantizer, best_pred.prediction_mode,
                                     encoder_pass );
@@ -383,16 +636,12 @@ void Encoder::luma_mb_apply_inter_prediction( const VP8Raster::Macroblock & orig
   frame_mb.set_base_motion_vector( best_mv );
 
   if ( best_pred == SPLITMV ) {
-    frame_mb.Y().forall_ij(
-      [&] ( YBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
-      {
-        auto & original_sb = original_mb.Y_sub_at( sb_column, sb_row );
-
-        frame_sb.mutable_coefficients().subtract_dct( original_sb,
-          reconstructed_mb.Y_sub_at( sb_column, sb_row ).contents() );
+    luma_mb_subtract_dct_quantize( original_mb, reconstructed_mb, frame_mb.Y(), quantizer.y() );
 
+    frame_mb.Y().forall(
+      [&] ( YBlock & frame_sb )
+      {
         frame_sb.set_Y_without_Y2();
-        frame_sb.mutable_coefficients() = YBlock::quantize( quantizer, frame_sb.coefficients() );
         frame_sb.calculate_has_nonzero();
       }
     );
@@ -409,20 +658,13 @@ void Encoder::luma_mb_apply_inter_prediction( const VP8Raster::Macroblock & orig
 
     SafeArray<int16_t, 16> walsh_input;
 
-    // XXX refactor this and its keyframe counterpart to remove the redundancy.
-    frame_mb.Y().forall_ij(
-      [&] ( YBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
-      {
-        auto & original_sb = original_mb.Y_sub_at( sb_column, sb_row );
-
-        frame_sb.mutable_coefficients().subtract_dct( original_sb,
-          reconstructed_mb.Y_sub_at( sb_column, sb_row ).contents() );
+    luma_mb_subtract_dct_quantize( original_mb, reconstructed_mb, frame_mb.Y(), quantizer.y(),
+                                   &walsh_input );
 
-        walsh_input.at( sb_column + 4 * sb_row ) = frame_sb.coefficients().at( 0 );
-        frame_sb.set_dc_coefficient( 0 );
+    frame_mb.Y().forall(
+      [&] ( YBlock & frame_sb )
+      {
         frame_sb.set_Y_after_Y2();
-
-        frame_sb.mutable_coefficients() = YBlock::quantize( quantizer, frame_sb.coefficients() );
         frame_sb.calculate_has_nonzero();
       }
     );
@@ -477,31 +719,11 @@ void Encoder::chroma_mb_inter_predict( const VP8Raster::Macroblock & original_mb
                                   reference.V(), reconstructed_mb.V.mutable_contents() );
   }
 
-  frame_mb.U().forall_ij(
-    [&] ( UVBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
-    {
-      auto & original_sb = original_mb.U_sub_at( sb_column, sb_row );
-
-      frame_sb.mutable_coefficients().subtract_dct( original_sb,
-        reconstructed_mb.U_sub_at( sb_column, sb_row ).contents() );
-
-      frame_sb.mutable_coefficients() = UVBlock::quantize( quantizer, frame_sb.coefficients() );
-      frame_sb.calculate_has_nonzero();
-    }
-  );
-
-  frame_mb.V().forall_ij(
-    [&] ( UVBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
-    {
-      auto & original_sb = original_mb.V_sub_at( sb_column, sb_row );
-
-      frame_sb.mutable_coefficients().subtract_dct( original_sb,
-        reconstructed_mb.V_sub_at( sb_column, sb_row ).contents() );
+  chroma_mb_subtract_dct_quantize( original_mb, reconstructed_mb, frame_mb.U(), frame_mb.V(),
+                                   quantizer.uv() );
 
-      frame_sb.mutable_coefficients() = UVBlock::quantize( quantizer, frame_sb.coefficients() );
-      frame_sb.calculate_has_nonzero();
-    }
-  );
+  frame_mb.U().forall( [&] ( UVBlock & frame_sb ) { frame_sb.calculate_has_nonzero(); } );
+  frame_mb.V().forall( [&] ( UVBlock & frame_sb ) { frame_sb.calculate_has_nonzero(); } );
 
   frame_mb.calculate_has_nonzero();
 }
@@ -584,14 +806,29 @@ pair<InterFrame &, double> Encoder::encode_raster<InterFrame>( const VP8Raster &
 
   InterFrame & frame = inter_frame_;
 
+  /* above the base layer, frames leave LAST_FRAME and the probabilities
+     alone; with three layers, the middle one owns GOLDEN_FRAME */
+  const uint8_t layer = temporal_layer();
+  const bool refresh_golden = ( layer == 0 ) ? refresh_golden_
+                                             : ( temporal_layers_ == 3 and layer == 1 );
+
   frame.mutable_header().quant_indices = quant_indices;
-  frame.mutable_header().refresh_entropy_probs = true;
-  frame.mutable_header().refresh_last = true;
+  frame.mutable_header().refresh_entropy_probs = ( layer == 0 );
+  frame.mutable_header().refresh_last = ( layer == 0 );
+  frame.mutable_header().log2_number_of_dct_partitions = log2_dct_partitions_;
 
-  Quantizer quantizer( frame.header().quant_indices );
-  MutableRasterHandle reconstructed_raster_handle { width(), height() };
+  /* copy_buffer_to_golden is only coded when golden isn't refreshed */
+  frame.mutable_header().refresh_golden_frame = refresh_golden;
+
+  if ( refresh_golden ) {
+    frame.mutable_header().copy_buffer_to_golden.clear();
+  }
+  else {
+    frame.mutable_header().copy_buffer_to_golden.reset( 0 );
+  }
 
-  update_rd_multipliers( quantizer );
+  const auto segment_indices = assign_segments( raster, frame );
+  MutableRasterHandle reconstructed_raster_handle { width(), height() };
 
   costs_.fill_token_costs( ProbabilityTables() );
 
@@ -601,6 +838,17 @@ pair<InterFrame &, double> Encoder::encode_raster<InterFrame>( const VP8Raster &
   costs_.fill_mv_component_costs( decoder_state_.probability_tables.motion_vector_probs );
   costs_.fill_mv_sad_costs();
 
+  /* the reference probabilities of the previous frame are our best guess
+     for the ones of this frame */
+  if ( frame.header().prob_inter > 0 and frame.header().prob_references_last > 0
+       and frame.header().prob_references_golden > 0 ) {
+    costs_.fill_reference_costs( frame.header().prob_inter,
+                                 frame.header().prob_references_last,
+                                 frame.header().prob_references_golden );
+  }
+
+  const unsigned int mb_columns = frame.macroblocks().width();
+
   raster.macroblocks_forall_ij(
     [&] ( VP8Raster::ConstMacroblock original_mb, unsigned int mb_column, unsigned int mb_row )
     {
@@ -608,10 +856,19 @@ pair<InterFrame &, double> Encoder::encode_raster<InterFrame>( const VP8Raster &
       auto temp_mb = temp_raster().macroblock( mb_column, mb_row );
       auto & frame_mb = frame.mutable_macroblocks().at( mb_column, mb_row );
 
+      const QuantIndices & mb_quant_indices = segment_indices.at( frame_mb.segment_id() );
+      const Quantizer quantizer( mb_quant_indices );
+      update_rd_multipliers( quantizer );
+
+      /* is this macroblock in the current intra-refresh stripe? */
+      const bool intra_refresh = ( intra_refresh_period_ > 0 ) and ( layer == 0 ) and
+        ( mb_column * intra_refresh_period_ / mb_columns == intra_refresh_position_ );
+
       // Process Y and Y2
       luma_mb_inter_predict( original_mb.macroblock(), reconstructed_mb, temp_mb, frame_mb,
                              quantizer, component_counts,
-                             frame.header().quant_indices.y_ac_qi, FIRST_PASS );
+                             mb_quant_indices.y_ac_qi, FIRST_PASS,
+                             intra_refresh );
 
       if ( frame_mb.inter_coded() ) {
         chroma_mb_inter_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
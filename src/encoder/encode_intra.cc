@@ -26,6 +26,8 @@
    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+#include <algorithm>
+#include <array>
 #include <limits>
 #include <typeinfo>
 
@@ -43,6 +45,8 @@ void Encoder::update_decoder_state( const KeyFrame & frame )
   if ( frame.header().refresh_entropy_probs ) {
     decoder_state_.probability_tables.coeff_prob_update( frame.header() );
   }
+
+  update_segmentation_map( frame );
 }
 
 void Encoder::luma_sb_apply_intra_prediction( const VP8Raster::Block4 & original_sb,
@@ -129,10 +133,16 @@ Encoder::MBPredictionData Encoder::luma_mb_best_prediction_mode( const VP8Raster
             reconstructed_sb, temp_sb, costs_.bmode_costs.at( above_mode ).at( left_mode ) );
 
           pred.rate += costs_.bmode_costs.at( above_mode ).at( left_mode ).at( sb_prediction_mode );
-          pred.distortion += sse( original_sb, reconstructed_sb.contents() );
+          pred.distortion += ( distortion_metric_ == SATD_DISTORTION )
+                             ? satd_distortion( original_sb, reconstructed_sb.contents() )
+                             : sse( original_sb, reconstructed_sb.contents() );
 
+          /* with TRELLIS_FINAL_MODE, B_PRED is trellis-quantized only if
+             it's picked (see luma_mb_apply_intra_prediction) */
           luma_sb_apply_intra_prediction( original_sb, reconstructed_sb, frame_sb,
-                                          quantizer, sb_prediction_mode, encoder_pass );
+                                          quantizer, sb_prediction_mode,
+                                          trellis_scope_ == TRELLIS_ALL_CANDIDATES
+                                          ? encoder_pass : FIRST_PASS );
         }
       );
 
@@ -144,7 +154,9 @@ Encoder::MBPredictionData Encoder::luma_mb_best_prediction_mode( const VP8Raster
 
       /* Here we compute variance, instead of SSE, because in this case
        * the average will be taken out from Y2 block into the Y2 block. */
-      pred.distortion = variance( original_mb.Y, prediction );
+      pred.distortion = ( distortion_metric_ == SATD_DISTORTION )
+                        ? satd_distortion( original_mb.Y, prediction )
+                        : variance( original_mb.Y, prediction );
 
       pred.rate = costs_.mbmode_costs.at( interframe ? 1 : 0 ).at( prediction_mode );
       pred.cost = rdcost( pred.rate, pred.distortion, RATE_MULTIPLIER,
@@ -178,28 +190,38 @@ void Encoder::luma_mb_apply_intra_prediction( const VP8Raster::Macroblock & orig
 
   if ( min_prediction_mode == B_PRED ) {
     frame_mb.Y2().set_coded( false );
+
+    if ( encoder_pass == SECOND_PASS and trellis_scope_ == TRELLIS_FINAL_MODE ) {
+      /* redo the subblocks, in order, now with trellis quantization */
+      reconstructed_mb.Y_sub_forall_ij(
+        [&] ( VP8Raster::Block4 & reconstructed_sb, unsigned int sb_column, unsigned int sb_row )
+        {
+          auto & frame_sb = frame_mb.Y().at( sb_column, sb_row );
+
+          reconstructed_sb.intra_predict( frame_sb.prediction_mode() );
+          luma_sb_apply_intra_prediction( original_mb.Y_sub_at( sb_column, sb_row ),
+                                          reconstructed_sb, frame_sb, quantizer,
+                                          frame_sb.prediction_mode(), SECOND_PASS );
+        }
+      );
+    }
+
     return;
   }
 
   SafeArray<int16_t, 16> walsh_input;
 
-  frame_mb.Y().forall_ij(
-    [&] ( YBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
+  luma_mb_subtract_dct_quantize( original_mb, reconstructed_mb, frame_mb.Y(),
+                                 make_optional( encoder_pass == FIRST_PASS, quantizer.y() ),
+                                 &walsh_input );
+
+  frame_mb.Y().forall(
+    [&] ( YBlock & frame_sb )
     {
-      auto & original_sb = original_mb.Y_sub_at( sb_column, sb_row );
       frame_sb.set_prediction_mode( KeyFrameMacroblock::implied_subblock_mode( min_prediction_mode ) );
-
-      frame_sb.mutable_coefficients().subtract_dct( original_sb,
-        reconstructed_mb.Y_sub_at( sb_column, sb_row ).contents() );
-
-      walsh_input.at( sb_column + 4 * sb_row ) = frame_sb.coefficients().at( 0 );
-      frame_sb.set_dc_coefficient( 0 );
       frame_sb.set_Y_after_Y2();
 
-      if ( encoder_pass == FIRST_PASS ) {
-        frame_sb.mutable_coefficients() = YBlock::quantize( quantizer, frame_sb.coefficients() );
-      }
-      else {
+      if ( encoder_pass != FIRST_PASS ) {
         trellis_quantize( frame_sb, quantizer );
       }
 
@@ -265,8 +287,14 @@ Encoder::MBPredictionData Encoder::chroma_mb_best_prediction_mode( const VP8Rast
     reconstructed_mb.U.intra_predict( ( mbmode )prediction_mode, u_predictors, u_prediction );
     reconstructed_mb.V.intra_predict( ( mbmode )prediction_mode, v_predictors, v_prediction );
 
-    pred.distortion = sse( original_mb.U, u_prediction )
-                    + sse( original_mb.V, v_prediction );
+    if ( distortion_metric_ == SATD_DISTORTION ) {
+      pred.distortion = satd_distortion( original_mb.U, u_prediction )
+                      + satd_distortion( original_mb.V, v_prediction );
+    }
+    else {
+      pred.distortion = sse( original_mb.U, u_prediction )
+                      + sse( original_mb.V, v_prediction );
+    }
 
     pred.rate = costs_.intra_uv_mode_costs.at( interframe ).at( prediction_mode );
     pred.cost = rdcost( pred.rate, pred.distortion, RATE_MULTIPLIER,
@@ -294,43 +322,21 @@ void Encoder::chroma_mb_apply_intra_prediction( const VP8Raster::Macroblock & or
 {
   frame_mb.U().at( 0, 0 ).set_prediction_mode( min_prediction_mode );
 
-  frame_mb.U().forall_ij(
-    [&] ( UVBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
-    {
-      auto & original_sb = original_mb.U_sub_at( sb_column, sb_row );
-
-      frame_sb.mutable_coefficients().subtract_dct( original_sb,
-        reconstructed_mb.U_sub_at( sb_column, sb_row ).contents() );
-
-      if ( encoder_pass == FIRST_PASS ) {
-        frame_sb.mutable_coefficients() = UVBlock::quantize( quantizer, frame_sb.coefficients() );
-      }
-      else {
-        trellis_quantize( frame_sb, quantizer );
-      }
+  chroma_mb_subtract_dct_quantize( original_mb, reconstructed_mb, frame_mb.U(), frame_mb.V(),
+                                   make_optional( encoder_pass == FIRST_PASS, quantizer.uv() ) );
 
-      frame_sb.calculate_has_nonzero();
-    }
-  );
-
-  frame_mb.V().forall_ij(
-    [&] ( UVBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
+  auto finish_block =
+    [&] ( UVBlock & frame_sb )
     {
-      auto & original_sb = original_mb.V_sub_at( sb_column, sb_row );
-
-      frame_sb.mutable_coefficients().subtract_dct( original_sb,
-        reconstructed_mb.V_sub_at( sb_column, sb_row ).contents() );
-
-      if ( encoder_pass == FIRST_PASS ) {
-        frame_sb.mutable_coefficients() = UVBlock::quantize( quantizer, frame_sb.coefficients() );
-      }
-      else {
+      if ( encoder_pass != FIRST_PASS ) {
         trellis_quantize( frame_sb, quantizer );
       }
 
       frame_sb.calculate_has_nonzero();
-    }
-  );
+    };
+
+  frame_mb.U().forall( finish_block );
+  frame_mb.V().forall( finish_block );
 }
 
 template <class MacroblockType>
@@ -354,6 +360,95 @@ void Encoder::chroma_mb_intra_predict( const VP8Raster::Macroblock & original_mb
                                     best_pred.prediction_mode, encoder_pass );
 }
 
+/* For each directional subblock mode, the offset (column, row) of the pixel
+ * that a pixel is predicted along. */
+struct SubblockDirection
+{
+  bmode mode;
+  int8_t dx;
+  int8_t dy;
+};
+
+static constexpr array<SubblockDirection, num_intra_b_modes - 2> subblock_directions = {{
+  { B_VE_PRED,  0, -1 }, { B_HE_PRED, -1,  0 },
+  { B_LD_PRED,  1, -1 }, { B_RD_PRED, -1, -1 },
+  { B_VR_PRED, -1, -2 }, { B_VL_PRED,  1, -2 },
+  { B_HD_PRED, -2, -1 }, { B_HU_PRED,  2, -1 }
+}};
+
+/*
+ * Picks the subblock modes that are worth a full evaluation. B_DC_PRED and
+ * B_TM_PRED are always picked; the directional modes are ranked by how much
+ * the source pixels (and the predictors next to them) change along their
+ * direction, which doesn't need any of the predictions to be computed.
+ * Returns the number of candidates written to `candidates`.
+ */
+template<class PredictorsType>
+static unsigned int luma_sb_candidate_modes( const VP8Raster::Block4 & original_sb,
+                                             const PredictorsType & predictors,
+                                             const unsigned int max_candidates,
+                                             SafeArray<bmode, num_intra_b_modes> & candidates )
+{
+  if ( max_candidates >= num_intra_b_modes ) {
+    for ( unsigned int i = 0; i < num_intra_b_modes; i++ ) {
+      candidates.at( i ) = ( bmode )i;
+    }
+
+    return num_intra_b_modes;
+  }
+
+  /* row -1 is the above predictor (including above-right),
+     column -1 is the left predictor */
+  auto pixel = [&]( const int column, const int row ) -> int
+    {
+      if ( row < 0 ) { return predictors.above[ column ]; }
+      if ( column < 0 ) { return predictors.left[ row ]; }
+      return original_sb.at( column, row );
+    };
+
+  auto known = []( const int column, const int row )
+    {
+      if ( row == -1 ) { return column >= -1 and column < 8; }
+      if ( column == -1 ) { return row >= 0 and row < 4; }
+      return row >= 0 and row < 4 and column >= 0 and column < 4;
+    };
+
+  array<pair<uint32_t, bmode>, num_intra_b_modes - 2> scores;
+
+  for ( size_t i = 0; i < subblock_directions.size(); i++ ) {
+    const SubblockDirection & direction = subblock_directions[ i ];
+    uint32_t sum = 0;
+    uint32_t count = 0;
+
+    for ( int row = 0; row < 4; row++ ) {
+      for ( int column = 0; column < 4; column++ ) {
+        const int source_column = column + direction.dx;
+        const int source_row = row + direction.dy;
+
+        if ( known( source_column, source_row ) ) {
+          sum += abs( pixel( column, row ) - pixel( source_column, source_row ) );
+          count++;
+        }
+      }
+    }
+
+    scores[ i ] = make_pair( ( sum << 4 ) / count, direction.mode );
+  }
+
+  stable_sort( scores.begin(), scores.end(),
+               []( const pair<uint32_t, bmode> & a, const pair<uint32_t, bmode> & b )
+               { return a.first < b.first; } );
+
+  candidates.at( 0 ) = B_DC_PRED;
+  candidates.at( 1 ) = B_TM_PRED;
+
+  for ( unsigned int i = 2; i < max_candidates; i++ ) {
+    candidates.at( i ) = scores[ i - 2 ].second;
+  }
+
+  return max_candidates;
+}
+
 /* This function outputs the prediction values to 'reconstructed_sb'
  * and returns the prediction mode.
  */
@@ -368,16 +463,24 @@ bmode Encoder::luma_sb_intra_predict( const VP8Raster::Block4 & original_sb,
 
   auto predictors = reconstructed_sb.predictors();
 
-  for ( unsigned int prediction_mode = 0; prediction_mode < num_intra_b_modes; prediction_mode++ ) {
-    reconstructed_sb.intra_predict( ( bmode )prediction_mode, predictors, prediction );
+  SafeArray<bmode, num_intra_b_modes> candidates;
+  const unsigned int candidate_count = luma_sb_candidate_modes( original_sb, predictors,
+                                                                bpred_candidates_,
+                                                                candidates );
 
-    uint32_t distortion = sse( original_sb, prediction );
+  for ( unsigned int i = 0; i < candidate_count; i++ ) {
+    const bmode prediction_mode = candidates.at( i );
+    reconstructed_sb.intra_predict( prediction_mode, predictors, prediction );
+
+    uint32_t distortion = ( distortion_metric_ == SATD_DISTORTION )
+                          ? satd_distortion( original_sb, prediction )
+                          : sse( original_sb, prediction );
     uint32_t error_val = rdcost( mode_costs.at( prediction_mode ), distortion,
                                  RATE_MULTIPLIER, DISTORTION_MULTIPLIER );
 
     if ( error_val < min_error ) {
       reconstructed_sb.mutable_contents().copy_from( prediction );
-      min_prediction_mode = ( bmode )prediction_mode;
+      min_prediction_mode = prediction_mode;
       min_error = error_val;
     }
   }
@@ -398,12 +501,11 @@ pair<KeyFrame &, double> Encoder::encode_raster<KeyFrame>( const VP8Raster & ras
 
   frame.mutable_header().quant_indices = quant_indices;
   frame.mutable_header().refresh_entropy_probs = true;
+  frame.mutable_header().log2_number_of_dct_partitions = log2_dct_partitions_;
 
-  Quantizer quantizer( frame.header().quant_indices );
+  const auto segment_indices = assign_segments( raster, frame );
   MutableRasterHandle reconstructed_raster_handle { width(), height() };
 
-  update_rd_multipliers( quantizer );
-
   TokenBranchCounts token_branch_counts;
 
   for ( size_t pass = FIRST_PASS;
@@ -422,6 +524,9 @@ pair<KeyFrame &, double> Encoder::encode_raster<KeyFrame>( const VP8Raster & ras
         auto temp_mb = temp_raster().macroblock( mb_column, mb_row );
         auto & frame_mb = frame.mutable_macroblocks().at( mb_column, mb_row );
 
+        const Quantizer quantizer( segment_indices.at( frame_mb.segment_id() ) );
+        update_rd_multipliers( quantizer );
+
         // Process Y and Y2
         luma_mb_intra_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
                                frame_mb, quantizer, (EncoderPass)pass );
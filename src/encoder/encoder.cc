@@ -28,10 +28,13 @@
 
 #include <algorithm>
 #include <array>
+#include <cmath>
 #include <cstdio>
 #include <limits>
 #include <utility>
 #include <chrono>
+#include <future>
+#include <thread>
 
 #include "block.hh"
 #include "encoder.hh"
@@ -96,8 +99,29 @@ Encoder::Encoder( const Encoder & encoder )
     has_state_( encoder.has_state_ ), costs_( encoder.costs_ ),
     two_pass_encoder_( encoder.two_pass_encoder_ ),
     encode_quality_( encoder.encode_quality_ ),
+    bpred_candidates_( encoder.bpred_candidates_ ),
+    distortion_metric_( encoder.distortion_metric_ ),
+    inter_search_effort_( encoder.inter_search_effort_ ),
+    trellis_levels_( encoder.trellis_levels_ ),
+    trellis_scope_( encoder.trellis_scope_ ),
+    refresh_golden_( encoder.refresh_golden_ ),
+    intra_refresh_period_( encoder.intra_refresh_period_ ),
+    intra_refresh_position_( encoder.intra_refresh_position_ ),
+    quantizer_search_threads_( encoder.quantizer_search_threads_ ),
+    wavefront_threads_( encoder.wavefront_threads_ ),
+    log2_dct_partitions_( encoder.log2_dct_partitions_ ),
+    aq_strength_( encoder.aq_strength_ ),
+    roi_map_( encoder.roi_map_ ),
+    roi_qi_delta_( encoder.roi_qi_delta_ ),
+    size_trimming_( encoder.size_trimming_ ),
+    trim_map_( encoder.trim_map_ ),
+    detect_scene_cuts_( encoder.detect_scene_cuts_ ),
+    frames_since_key_frame_( encoder.frames_since_key_frame_ ),
+    temporal_layers_( encoder.temporal_layers_ ),
+    temporal_position_( encoder.temporal_position_ ),
     loop_filter_level_( encoder.loop_filter_level_ ),
     last_y_ac_qi_( encoder.last_y_ac_qi_ ),
+    rate_model_( encoder.rate_model_ ),
     encode_stats_( encoder.encode_stats_ )
 {}
 
@@ -108,12 +132,33 @@ Encoder::Encoder( Encoder && encoder )
     has_state_( encoder.has_state_ ), costs_( move( encoder.costs_ ) ),
     two_pass_encoder_( encoder.two_pass_encoder_ ),
     encode_quality_( encoder.encode_quality_ ),
+    bpred_candidates_( encoder.bpred_candidates_ ),
+    distortion_metric_( encoder.distortion_metric_ ),
+    inter_search_effort_( encoder.inter_search_effort_ ),
+    trellis_levels_( encoder.trellis_levels_ ),
+    trellis_scope_( encoder.trellis_scope_ ),
+    refresh_golden_( encoder.refresh_golden_ ),
+    intra_refresh_period_( encoder.intra_refresh_period_ ),
+    intra_refresh_position_( encoder.intra_refresh_position_ ),
+    quantizer_search_threads_( encoder.quantizer_search_threads_ ),
+    wavefront_threads_( encoder.wavefront_threads_ ),
+    log2_dct_partitions_( encoder.log2_dct_partitions_ ),
+    aq_strength_( encoder.aq_strength_ ),
+    roi_map_( move( encoder.roi_map_ ) ),
+    roi_qi_delta_( encoder.roi_qi_delta_ ),
+    size_trimming_( encoder.size_trimming_ ),
+    trim_map_( move( encoder.trim_map_ ) ),
+    detect_scene_cuts_( encoder.detect_scene_cuts_ ),
+    frames_since_key_frame_( encoder.frames_since_key_frame_ ),
+    temporal_layers_( encoder.temporal_layers_ ),
+    temporal_position_( encoder.temporal_position_ ),
     key_frame_( move( encoder.key_frame_ ) ),
     subsampled_key_frame_( move( encoder.subsampled_key_frame_ ) ),
     inter_frame_( move( encoder.inter_frame_ ) ),
     subsampled_inter_frame_( move( encoder.subsampled_inter_frame_ ) ),
     loop_filter_level_( move( encoder.loop_filter_level_ ) ),
     last_y_ac_qi_( move( encoder.last_y_ac_qi_ ) ),
+    rate_model_( move( encoder.rate_model_ ) ),
     encode_stats_( move( encoder.encode_stats_ ) )
 {}
 
@@ -126,17 +171,101 @@ Encoder & Encoder::operator=( Encoder && encoder )
   costs_ = move( encoder.costs_ );
   two_pass_encoder_ = encoder.two_pass_encoder_;
   encode_quality_ = encoder.encode_quality_;
+  bpred_candidates_ = encoder.bpred_candidates_;
+  distortion_metric_ = encoder.distortion_metric_;
+  inter_search_effort_ = encoder.inter_search_effort_;
+  trellis_levels_ = encoder.trellis_levels_;
+  trellis_scope_ = encoder.trellis_scope_;
+  refresh_golden_ = encoder.refresh_golden_;
+  intra_refresh_period_ = encoder.intra_refresh_period_;
+  intra_refresh_position_ = encoder.intra_refresh_position_;
+  quantizer_search_threads_ = encoder.quantizer_search_threads_;
+  wavefront_threads_ = encoder.wavefront_threads_;
+  log2_dct_partitions_ = encoder.log2_dct_partitions_;
+  aq_strength_ = encoder.aq_strength_;
+  roi_map_ = move( encoder.roi_map_ );
+  roi_qi_delta_ = encoder.roi_qi_delta_;
+  size_trimming_ = encoder.size_trimming_;
+  trim_map_ = move( encoder.trim_map_ );
+  detect_scene_cuts_ = encoder.detect_scene_cuts_;
+  frames_since_key_frame_ = encoder.frames_since_key_frame_;
+  temporal_layers_ = encoder.temporal_layers_;
+  temporal_position_ = encoder.temporal_position_;
   key_frame_ = move( encoder.key_frame_ );
   subsampled_key_frame_ = move( encoder.subsampled_key_frame_ );
   inter_frame_ = move( encoder.inter_frame_ );
   subsampled_inter_frame_ = move( encoder.subsampled_inter_frame_ );
   loop_filter_level_ = move( encoder.loop_filter_level_ );
   last_y_ac_qi_ = move( encoder.last_y_ac_qi_ );
+  rate_model_ = move( encoder.rate_model_ );
   encode_stats_ = move( encoder.encode_stats_ );
 
   return *this;
 }
 
+void Encoder::set_bpred_candidates( const uint8_t candidates )
+{
+  /* B_DC_PRED and B_TM_PRED are always evaluated */
+  bpred_candidates_ = max( static_cast<uint8_t>( 2 ),
+                           min( static_cast<uint8_t>( num_intra_b_modes ), candidates ) );
+}
+
+void Encoder::set_dct_partitions( const uint8_t count )
+{
+  switch ( count ) {
+  case 1: log2_dct_partitions_ = 0; break;
+  case 2: log2_dct_partitions_ = 1; break;
+  case 4: log2_dct_partitions_ = 2; break;
+  case 8: log2_dct_partitions_ = 3; break;
+  default: throw runtime_error( "the number of DCT partitions must be 1, 2, 4 or 8" );
+  }
+}
+
+void Encoder::set_trellis_levels( const uint8_t levels )
+{
+  trellis_levels_ = ( levels == 0 ) ? 1
+                  : ( levels > MAX_TRELLIS_LEVELS ) ? MAX_TRELLIS_LEVELS
+                  : levels;
+}
+
+void Encoder::set_roi_map( const vector<uint8_t> & map, const uint8_t qi_delta )
+{
+  if ( not map.empty() and map.size() != VP8Raster::macroblock_dimension( width() )
+                                         * VP8Raster::macroblock_dimension( height() ) ) {
+    throw runtime_error( "the region of interest map needs one entry per macroblock" );
+  }
+
+  roi_map_ = map;
+  roi_qi_delta_ = qi_delta;
+}
+
+void Encoder::set_temporal_layers( const uint8_t layers )
+{
+  if ( layers < 1 or layers > 3 ) {
+    throw runtime_error( "the number of temporal layers must be 1, 2 or 3" );
+  }
+
+  temporal_layers_ = layers;
+  temporal_position_ = 0;
+}
+
+uint8_t Encoder::temporal_layer() const
+{
+  /* with two layers, every other frame is in the base layer. with three,
+     every fourth one is, and the middle layer is halfway between. */
+  static constexpr array<uint8_t, 4> three_layers = { { 0, 2, 1, 2 } };
+
+  if ( not has_state_ ) {
+    return 0;
+  }
+
+  switch ( temporal_layers_ ) {
+  case 2: return temporal_position_ % 2;
+  case 3: return three_layers.at( temporal_position_ % 4 );
+  default: return 0;
+  }
+}
+
 uint32_t Encoder::minihash() const
 {
   return static_cast<uint32_t>( DecoderHash( decoder_state_.hash(), references_.last.hash(),
@@ -161,6 +290,24 @@ vector<uint8_t> Encoder::write_frame( const FrameType & frame,
   safe_references_.golden = move( SafeReferences::load( references_.golden ) );
   safe_references_.alternative = move( SafeReferences::load( references_.alternative ) );
 
+  /* only the base layer refreshes LAST_FRAME, so that's where the golden
+     refresh and the intra-refresh stripes wait for */
+  const bool base_layer = frame.header().key_frame() or temporal_layer() == 0;
+
+  /* a golden refresh only applies to one frame (keyframes refresh it anyway) */
+  if ( base_layer ) {
+    refresh_golden_ = false;
+  }
+
+  frames_since_key_frame_ = frame.header().key_frame() ? 0 : frames_since_key_frame_ + 1;
+  temporal_position_ = frame.header().key_frame() ? 1 : ( temporal_position_ + 1 ) % 4;
+
+  /* move on to the next intra-refresh stripe; a keyframe refreshes them all */
+  if ( intra_refresh_period_ > 0 and base_layer ) {
+    intra_refresh_position_ = frame.header().key_frame()
+                              ? 0 : ( intra_refresh_position_ + 1 ) % intra_refresh_period_;
+  }
+
   if ( encode_quality_ == REALTIME_QUALITY ) {
     loop_filter_level_.reset( frame.header().loop_filter_level );
     last_y_ac_qi_.reset( frame.header().quant_indices.y_ac_qi );
@@ -271,8 +418,9 @@ void Encoder::trellis_quantize( FrameSubblockType & frame_sb,
     return;
   }
 
-  const uint8_t LEVELS = 2;
-  SafeArray<SafeArray<TrellisNode, LEVELS>, 17> trellis;
+  const uint8_t LEVELS = trellis_levels_;
+  const SafeArray<int8_t, MAX_TRELLIS_LEVELS> level_offsets { { 0, -1, 1, -2 } };
+  SafeArray<SafeArray<TrellisNode, MAX_TRELLIS_LEVELS>, 17> trellis;
 
   // setting up the sentinel node for the trellis
   for ( size_t i = 0; i < LEVELS; i++ ) {
@@ -290,35 +438,30 @@ void Encoder::trellis_quantize( FrameSubblockType & frame_sb,
     const int16_t quantized_coeff = original_coeff /
                                     ( idx == 0 ? dc_factor : ac_factor );
 
-    // evaluate two quantizer levels: {q, q - 1}
-    // it's possible to explore more
+    // evaluate the quantizer levels {q, q - 1, q + 1, q - 2}, in magnitude
     for ( size_t q_shift = 0; q_shift < LEVELS; q_shift++ ) {
       TrellisNode & current_node = trellis.at( idx ).at( q_shift );
 
-      int16_t candidate_coeff = quantized_coeff;
+      const int16_t magnitude = abs( quantized_coeff ) + level_offsets.at( q_shift );
 
-      if ( candidate_coeff < 0 ) {
-        candidate_coeff += q_shift;
-        candidate_coeff = min( ( int16_t )0, candidate_coeff );
-      }
-      else if ( candidate_coeff > 0 or q_shift == 0 )  {
-        candidate_coeff -= q_shift;
-        candidate_coeff = max( ( int16_t )0, candidate_coeff );
-      }
-      else { // candidate_coeff == 0 and q_shift != 0
+      if ( q_shift != 0 and ( magnitude < 0 or magnitude > 2047
+                              or ( magnitude == 0 and quantized_coeff == 0 ) ) ) {
+        // same as an earlier candidate, or out of range
         current_node = trellis.at( idx ).at( q_shift - 1 );
         continue;
       }
 
+      const int16_t candidate_coeff = ( original_coeff < 0 ) ? -magnitude : magnitude;
+
       int16_t diff = ( original_coeff - candidate_coeff * ( idx == 0 ? dc_factor : ac_factor ) );
       uint32_t sse = diff * diff;
 
       current_node.coeff = candidate_coeff;
       current_node.token = Costs::token_for_coeff( candidate_coeff );
 
-      array<uint32_t, LEVELS> distortions;
-      array<uint32_t, LEVELS> rates;
-      array<uint32_t, LEVELS> rd_costs;
+      array<uint32_t, MAX_TRELLIS_LEVELS> distortions;
+      array<uint32_t, MAX_TRELLIS_LEVELS> rates;
+      array<uint32_t, MAX_TRELLIS_LEVELS> rd_costs;
 
       // fill the trellis for current coeff index and select the best
       uint8_t best_next = numeric_limits<uint8_t>::max();
@@ -384,7 +527,7 @@ void Encoder::trellis_quantize( FrameSubblockType & frame_sb,
 
   // walking the minium path through trellis
   uint32_t min_cost = numeric_limits<uint32_t>::max();
-  size_t min_choice;
+  size_t min_choice = 0;
   for ( size_t i = 0; i < LEVELS; i++ ) {
     if ( trellis.at( first_index ).at( i ).cost < min_cost ) {
       min_cost = trellis.at( first_index ).at( i ).cost;
@@ -415,6 +558,19 @@ uint32_t Encoder::rdcost( uint32_t rate, uint32_t distortion,
          + distortion * distortion_multiplier;
 }
 
+/* For a residual whose energy is all in one Hadamard coefficient, this is
+ * exactly its SSE; a residual spread over many coefficients (and so more
+ * expensive to code) comes out larger than its SSE (up to 16 times, so
+ * it is capped to keep rdcost() from overflowing). */
+template<unsigned int size>
+uint32_t Encoder::satd_distortion( const VP8Raster::Block<size> & block,
+                                   const TwoDSubRange<uint8_t, size, size> & prediction )
+{
+  const uint64_t value = satd( block, prediction );
+  return min<uint64_t>( ( value * value ) / ( size * size ),
+                        numeric_limits<uint32_t>::max() / 128 );
+}
+
 template<class FrameType>
 void Encoder::optimize_probability_tables( FrameType & frame, const TokenBranchCounts & token_branch_counts )
 {
@@ -456,6 +612,248 @@ void Encoder::optimize_prob_skip( Frame<FrameHeaderType, MacroblockType> & frame
   frame.mutable_header().prob_skip_false.reset( Encoder::calc_prob( no_skip_count, total_count ) );
 }
 
+template<class FrameType>
+void Encoder::update_segmentation_map( const FrameType & frame )
+{
+  if ( not decoder_state_.segmentation.initialized() ) {
+    return;
+  }
+
+  SegmentationMap & map = decoder_state_.segmentation.get().map;
+
+  frame.macroblocks().forall_ij(
+    [&] ( const auto & frame_mb, unsigned int mb_column, unsigned int mb_row )
+    {
+      map.at( mb_column, mb_row ) = frame_mb.segment_id();
+    }
+  );
+}
+
+/* segment 0 holds the average macroblocks, 1 the flat ones (where coding
+   artifacts show the most), 2 the busy ones (which mask them) and 3 the
+   region of interest. while size trimming, segment 2 holds the trimmed
+   macroblocks instead, and the busy ones stay in segment 0. */
+template<class FrameType>
+SafeArray<QuantIndices, num_segments> Encoder::assign_segments( const VP8Raster & raster,
+                                                                FrameType & frame ) const
+{
+  const QuantIndices & quant_indices = frame.header().quant_indices;
+
+  SafeArray<QuantIndices, num_segments> segment_indices;
+  for ( uint8_t i = 0; i < num_segments; i++ ) {
+    segment_indices.at( i ) = quant_indices;
+  }
+
+  auto & macroblocks = frame.mutable_macroblocks();
+
+  if ( aq_strength_ == 0 and roi_map_.empty() and trim_map_.empty() ) {
+    if ( frame.header().update_segmentation.initialized() ) {
+      frame.mutable_header().update_segmentation.clear();
+      macroblocks.forall( [] ( auto & frame_mb )
+                          { frame_mb.mutable_segment_id_update().clear(); } );
+    }
+
+    return segment_indices;
+  }
+
+  /* the activity of a macroblock is the log of its luma variance */
+  vector<double> activities( macroblocks.width() * macroblocks.height(), 0.0 );
+  double mean_activity = 0.0;
+
+  if ( aq_strength_ > 0 ) {
+    /* against a flat prediction, variance() is the luma's own */
+    static TwoD<uint8_t> flat_storage( 16, 16 );
+    static const TwoDSubRange<uint8_t, 16, 16> flat( flat_storage, 0, 0 );
+
+    raster.macroblocks_forall_ij(
+      [&] ( VP8Raster::ConstMacroblock original_mb, unsigned int mb_column, unsigned int mb_row )
+      {
+        const double activity = log2( 1.0 + variance( original_mb.Y(), flat ) / 256.0 );
+        activities.at( mb_row * macroblocks.width() + mb_column ) = activity;
+        mean_activity += activity;
+      }
+    );
+
+    mean_activity /= activities.size();
+  }
+
+  SafeArray<unsigned int, num_segments> segment_counts {{}};
+  SegmentationMap segment_map( macroblocks.width(), macroblocks.height() );
+
+  macroblocks.forall_ij(
+    [&] ( auto & frame_mb, unsigned int mb_column, unsigned int mb_row )
+    {
+      const size_t index = mb_row * macroblocks.width() + mb_column;
+      uint8_t segment = 0;
+
+      if ( not roi_map_.empty() and roi_map_.at( index ) ) {
+        segment = 3;
+      }
+      else if ( not trim_map_.empty() and trim_map_.at( index ) ) {
+        segment = 2;
+      }
+      else if ( aq_strength_ > 0 and activities.at( index ) < mean_activity - 1.0 ) {
+        segment = 1;
+      }
+      else if ( aq_strength_ > 0 and trim_map_.empty()
+                and activities.at( index ) > mean_activity + 1.0 ) {
+        segment = 2;
+      }
+
+      segment_counts.at( segment )++;
+      frame_mb.mutable_segment_id_update().reset( segment );
+      frame_mb.update_segmentation( segment_map );
+    }
+  );
+
+  /* the deltas are relative to the frame's quantizer, and shouldn't take it
+     out of range. the trimmed macroblocks keep the quantizer that trimming
+     chose, one step coarser than the frame's. */
+  const int segment_2_delta = trim_map_.empty() ? aq_strength_ : 1;
+  const SafeArray<int, num_segments> deltas {{ 0, -aq_strength_, segment_2_delta, -roi_qi_delta_ }};
+
+  UpdateSegmentation update_segmentation;
+  update_segmentation.update_mb_segmentation_map = true;
+
+  SegmentFeatureData feature_data;
+  feature_data.segment_feature_mode = false;
+
+  for ( uint8_t i = 0; i < num_segments; i++ ) {
+    const int y_ac_qi = max( 0, min( 127, quant_indices.y_ac_qi + deltas.at( i ) ) );
+    segment_indices.at( i ).y_ac_qi = y_ac_qi;
+
+    if ( y_ac_qi != quant_indices.y_ac_qi ) {
+      feature_data.quantizer_update.at( i ).initialize( y_ac_qi - quant_indices.y_ac_qi );
+    }
+  }
+
+  update_segmentation.segment_feature_data.initialize( feature_data );
+
+  /* the probabilities of the segment id tree: { 0, 1 } against { 2, 3 },
+     then 0 against 1 and 2 against 3 */
+  auto tree_prob = [] ( const unsigned int false_count, const unsigned int total )
+    {
+      return total == 0 ? 255u : max( 1u, calc_prob( false_count, total ) );
+    };
+
+  const array<unsigned int, 3> tree_probs {{
+    tree_prob( segment_counts.at( 0 ) + segment_counts.at( 1 ),
+               segment_counts.at( 0 ) + segment_counts.at( 1 ) + segment_counts.at( 2 ) + segment_counts.at( 3 ) ),
+    tree_prob( segment_counts.at( 0 ), segment_counts.at( 0 ) + segment_counts.at( 1 ) ),
+    tree_prob( segment_counts.at( 2 ), segment_counts.at( 2 ) + segment_counts.at( 3 ) ) }};
+
+  update_segmentation.mb_segmentation_map.initialize();
+
+  for ( uint8_t i = 0; i < tree_probs.size(); i++ ) {
+    if ( tree_probs.at( i ) != 255 ) {
+      update_segmentation.mb_segmentation_map.get().at( i ).initialize( tree_probs.at( i ) );
+    }
+  }
+
+  frame.mutable_header().update_segmentation.reset( move( update_segmentation ) );
+
+  return segment_indices;
+}
+
+template<class FrameType>
+uint8_t Encoder::estimate_best_loopfilter_level( const VP8Raster & original,
+                                                 const VP8Raster & reconstructed,
+                                                 FrameType & frame )
+{
+  const unsigned int mb_width = frame.macroblocks().width();
+  const unsigned int mb_height = frame.macroblocks().height();
+
+  /* about one in sixteen macroblocks, but not on the top or left edge, where
+     there's no macroblock edge to filter */
+  const unsigned int stride = ( mb_width >= 8 and mb_height >= 8 ) ? 4 : 2;
+
+  vector<pair<unsigned int, unsigned int>> samples;
+
+  for ( unsigned int row = min( 1u, mb_height - 1 ); row < mb_height; row += stride ) {
+    for ( unsigned int column = min( 1u, mb_width - 1 ); column < mb_width; column += stride ) {
+      samples.emplace_back( column, row );
+    }
+  }
+
+  auto distortion = [&] ( const uint8_t lf_level )
+    {
+      frame.mutable_header().loop_filter_level = lf_level;
+      decoder_state_.filter_adjustments.reset( frame.header() );
+
+      uint64_t total = 0;
+
+      for ( const auto & sample : samples ) {
+        const unsigned int column = sample.first;
+        const unsigned int row = sample.second;
+
+        /* the filter reaches into the neighbors above and to the left */
+        vector<pair<unsigned int, unsigned int>> region { sample };
+
+        if ( column > 0 ) { region.emplace_back( column - 1, row ); }
+        if ( row > 0 ) { region.emplace_back( column, row - 1 ); }
+
+        for ( const auto & mb : region ) {
+          const auto source_mb = reconstructed.macroblock( mb.first, mb.second );
+          auto target_mb = temp_raster().macroblock( mb.first, mb.second );
+
+          target_mb.Y.mutable_contents().copy_from( source_mb.macroblock().Y.contents() );
+          target_mb.U.mutable_contents().copy_from( source_mb.macroblock().U.contents() );
+          target_mb.V.mutable_contents().copy_from( source_mb.macroblock().V.contents() );
+        }
+
+        frame.loopfilter_macroblock( decoder_state_.segmentation, decoder_state_.filter_adjustments,
+                                     column, row, temp_raster() );
+
+        for ( const auto & mb : region ) {
+          const auto original_mb = original.macroblock( mb.first, mb.second );
+          const auto filtered_mb = temp_raster().macroblock( mb.first, mb.second );
+
+          total += sse( original_mb.macroblock().Y, filtered_mb.Y.contents() );
+          total += sse( original_mb.macroblock().U, filtered_mb.U.contents() );
+          total += sse( original_mb.macroblock().V, filtered_mb.V.contents() );
+        }
+      }
+
+      return total;
+    };
+
+  /* start from the level of the previous frame, and go up while that
+     doesn't make things worse */
+  const int start_level = loop_filter_level_.initialized() ? loop_filter_level_.get() : 0;
+
+  int best_lf_level = start_level;
+  uint64_t best_distortion = distortion( start_level );
+
+  for ( int lf_level = start_level + 1; lf_level <= 63; lf_level++ ) {
+    const uint64_t current_distortion = distortion( lf_level );
+
+    if ( current_distortion > best_distortion ) {
+      break;
+    }
+    else if ( current_distortion < best_distortion ) {
+      best_distortion = current_distortion;
+      best_lf_level = lf_level;
+    }
+  }
+
+  /* if a stronger filter didn't help, maybe a weaker one does */
+  if ( best_lf_level == start_level ) {
+    for ( int lf_level = start_level - 1; lf_level >= 0; lf_level-- ) {
+      const uint64_t current_distortion = distortion( lf_level );
+
+      if ( current_distortion > best_distortion ) {
+        break;
+      }
+      else if ( current_distortion < best_distortion ) {
+        best_distortion = current_distortion;
+        best_lf_level = lf_level;
+      }
+    }
+  }
+
+  return best_lf_level;
+}
+
 template<class FrameType>
 void Encoder::apply_best_loopfilter_settings( const VP8Raster & original,
                                               VP8Raster & reconstructed,
@@ -470,49 +868,56 @@ void Encoder::apply_best_loopfilter_settings( const VP8Raster & original,
   }
 
   uint8_t best_lf_level = 0;
-  double best_ssim = -1.0;
 
-  uint8_t min_lf_level = 0;
-  uint8_t max_lf_level = 63;
+  if ( encode_quality_ == REALTIME_QUALITY ) {
+    best_lf_level = estimate_best_loopfilter_level( original, reconstructed, frame );
+    encode_stats_.ssim.clear();
+  }
+  else {
+    double best_ssim = -1.0;
 
-  if ( loop_filter_level_.initialized() ) {
-    if ( loop_filter_level_.get() > 0 ) {
-      min_lf_level = loop_filter_level_.get() - 1;
-    }
-    else {
-      min_lf_level = 0;
-    }
+    uint8_t min_lf_level = 0;
+    uint8_t max_lf_level = 63;
 
-    max_lf_level = min( 63u, loop_filter_level_.get() + 1u );
-  }
+    if ( loop_filter_level_.initialized() ) {
+      if ( loop_filter_level_.get() > 0 ) {
+        min_lf_level = loop_filter_level_.get() - 1;
+      }
+      else {
+        min_lf_level = 0;
+      }
 
-  for ( uint8_t lf_level = min_lf_level; lf_level <= max_lf_level; lf_level++ ) {
-    temp_raster().copy_from( reconstructed );
+      max_lf_level = min( 63u, loop_filter_level_.get() + 1u );
+    }
 
-    frame.mutable_header().loop_filter_level = lf_level;
+    for ( uint8_t lf_level = min_lf_level; lf_level <= max_lf_level; lf_level++ ) {
+      temp_raster().copy_from( reconstructed );
 
-    decoder_state_.filter_adjustments.reset( frame.header() );
+      frame.mutable_header().loop_filter_level = lf_level;
 
-    frame.loopfilter( decoder_state_.segmentation, decoder_state_.filter_adjustments, temp_raster() );
+      decoder_state_.filter_adjustments.reset( frame.header() );
 
-    /* XXX This is taking too much time and is very inefficient. */
-    double ssim = temp_raster().quality( original );
+      frame.loopfilter( decoder_state_.segmentation, decoder_state_.filter_adjustments, temp_raster() );
 
-    if ( ssim > best_ssim ) {
-      best_ssim = ssim;
-      best_lf_level = lf_level;
-    }
-    else {
-      break;
+      /* XXX This is taking too much time and is very inefficient. */
+      double ssim = temp_raster().quality( original );
+
+      if ( ssim > best_ssim ) {
+        best_ssim = ssim;
+        best_lf_level = lf_level;
+      }
+      else {
+        break;
+      }
     }
+
+    encode_stats_.ssim.reset( best_ssim );
   }
 
   frame.mutable_header().loop_filter_level = best_lf_level;
   decoder_state_.filter_adjustments.reset( frame.header() );
 
   frame.loopfilter( decoder_state_.segmentation, decoder_state_.filter_adjustments, reconstructed );
-
-  encode_stats_.ssim.reset( best_ssim );
 }
 
 template<class FrameType>
@@ -522,36 +927,79 @@ FrameType & Encoder::encode_with_quantizer_search( const VP8Raster & raster,
   int y_ac_qi_min = 0;
   int y_ac_qi_max = 127;
 
-  QuantIndices quant_indices;
-
-  bool found = false;
+  /* if no quantizer reaches the minimum SSIM, the finest one is used */
   size_t best_y_ac_qi = 0;
 
+  const size_t probe_count = ( quantizer_search_threads_ > 0 )
+                             ? quantizer_search_threads_
+                             : max( 1u, thread::hardware_concurrency() );
+
+  /* this is a k-ary search: each round encodes with up to probe_count
+     quantizers that are evenly spaced in the remaining interval, all at the
+     same time. the first one is encoded by this encoder and the others by
+     copies of it. with one probe, this is a plain binary search. */
   while ( y_ac_qi_min <= y_ac_qi_max ) {
-    quant_indices.y_ac_qi = ( y_ac_qi_min + y_ac_qi_max ) / 2;
+    const int span = y_ac_qi_max - y_ac_qi_min;
 
-    pair<FrameType &, double> encoded_frame = encode_raster<FrameType>( raster, quant_indices, true );
+    vector<int> candidates;
 
-    double current_ssim = encoded_frame.second;
+    for ( size_t i = 1; i <= probe_count and i <= static_cast<size_t>( span ) + 1; i++ ) {
+      const int candidate = y_ac_qi_min + i * span / ( probe_count + 1 );
 
-    if ( current_ssim >= minimum_ssim || ( y_ac_qi_min == y_ac_qi_max && not found ) ) {
-      // this is a potential answer, let's save it
-      found = true;
-      best_y_ac_qi = quant_indices.y_ac_qi;
+      if ( candidates.empty() or candidates.back() != candidate ) {
+        candidates.push_back( candidate );
+      }
     }
 
-    if ( y_ac_qi_min == y_ac_qi_max ) {
-      break;
+    auto probe = [&raster] ( Encoder & encoder, const int y_ac_qi )
+      {
+        QuantIndices quant_indices;
+        quant_indices.y_ac_qi = y_ac_qi;
+        return encoder.encode_raster<FrameType>( raster, quant_indices, false, true ).second;
+      };
+
+    /* the copies have to be made before this encoder starts probing */
+    vector<Encoder> probe_encoders;
+    probe_encoders.reserve( candidates.size() - 1 );
+
+    for ( size_t i = 1; i < candidates.size(); i++ ) {
+      probe_encoders.emplace_back( *this );
+    }
+
+    vector<future<double>> probe_results;
+
+    for ( size_t i = 1; i < candidates.size(); i++ ) {
+      probe_results.push_back( async( launch::async, probe,
+                                      ref( probe_encoders.at( i - 1 ) ), candidates.at( i ) ) );
     }
 
-    if ( current_ssim < minimum_ssim ) {
-      y_ac_qi_max = quant_indices.y_ac_qi - 1;
+    vector<double> ssims { probe( *this, candidates.front() ) };
+
+    for ( auto & result : probe_results ) {
+      ssims.push_back( result.get() );
     }
-    else {
-      y_ac_qi_min = quant_indices.y_ac_qi + 1;
+
+    /* keep the coarsest quantizer that reaches the minimum SSIM, and
+       continue between it and the next probe that doesn't */
+    int next_y_ac_qi_min = y_ac_qi_min;
+    int next_y_ac_qi_max = y_ac_qi_max;
+
+    for ( size_t i = 0; i < candidates.size(); i++ ) {
+      if ( ssims.at( i ) >= minimum_ssim ) {
+        best_y_ac_qi = candidates.at( i );
+        next_y_ac_qi_min = candidates.at( i ) + 1;
+        next_y_ac_qi_max = y_ac_qi_max;
+      }
+      else if ( next_y_ac_qi_max == y_ac_qi_max ) {
+        next_y_ac_qi_max = candidates.at( i ) - 1;
+      }
     }
+
+    y_ac_qi_min = next_y_ac_qi_min;
+    y_ac_qi_max = next_y_ac_qi_max;
   }
 
+  QuantIndices quant_indices;
   quant_indices.y_ac_qi = best_y_ac_qi;
   return encode_raster<FrameType>( raster, quant_indices, false ).first;
 }
@@ -562,6 +1010,15 @@ vector<uint8_t> Encoder::encode_with_quantizer( const VP8Raster & raster, const
     throw runtime_error( "scaling is not supported" );
   }
 
+  if ( scene_cut( raster ) ) {
+    force_key_frame();
+  }
+
+  return encode_frame( raster, y_ac_qi );
+}
+
+vector<uint8_t> Encoder::encode_frame( const VP8Raster & raster, const uint8_t y_ac_qi )
+{
   QuantIndices quant_indices;
   quant_indices.y_ac_qi = y_ac_qi;
 
@@ -580,6 +1037,10 @@ vector<uint8_t> Encoder::encode_with_minimum_ssim( const VP8Raster & raster, con
     throw runtime_error( "scaling is not supported" );
   }
 
+  if ( scene_cut( raster ) ) {
+    force_key_frame();
+  }
+
   if ( not has_state_ ) {
     has_state_ = true;
     return write_frame( encode_with_quantizer_search<KeyFrame>( raster, minimum_ssim ) );
@@ -594,6 +1055,10 @@ vector<uint8_t> Encoder::encode_with_target_size( const VP8Raster & raster, cons
     throw runtime_error( "scaling is not supported" );
   }
 
+  if ( scene_cut( raster ) ) {
+    force_key_frame();
+  }
+
   int y_qi_min = 4;
   int y_qi_max = 127;
 
@@ -607,25 +1072,304 @@ vector<uint8_t> Encoder::encode_with_target_size( const VP8Raster & raster, cons
     y_qi_max = min( y_qi_max, last_y_ac_qi_.get() + radius );
   }
 
+  const int y_qi_floor = y_qi_min;
   uint8_t best_y_qi = numeric_limits<uint8_t>::max();
 
-  size_t estimated_size = target_size;
+  /* keyframes are much larger than the inter frames the rate model follows */
+  const bool use_rate_model = has_state_;
+
+  /* with the rate model, each probe goes where the model expects the target
+     size to be, given the size at the previous probe of this frame (the
+     first one uses the model's own guess). when a guess doesn't at least
+     halve the search interval, the next probe is a plain bisection. */
+  int last_probe_qi = -1;
+  size_t last_probe_size = 0;
+  size_t best_estimated_size = 0;
+  bool bisect = not use_rate_model;
 
   while ( y_qi_min <= y_qi_max ) {
-    size_t y_qi = ( y_qi_min + y_qi_max ) / 2;
-    estimated_size = estimate_frame_size( raster, y_qi );
+    int y_qi = ( y_qi_min + y_qi_max ) / 2;
+
+    if ( not bisect ) {
+      if ( last_probe_qi >= 0 ) {
+        y_qi = rate_model_.predict( target_size, last_probe_qi, last_probe_size );
+      }
+      else if ( rate_model_.ready() ) {
+        y_qi = rate_model_.predict( target_size );
+      }
+
+      y_qi = max( y_qi_min, min( y_qi_max, y_qi ) );
+    }
+
+    const int interval = y_qi_max - y_qi_min;
+    const size_t estimated_size = estimate_frame_size( raster, y_qi );
+
+    if ( use_rate_model and last_probe_qi >= 0 ) {
+      rate_model_.update_slope( last_probe_qi, last_probe_size,
+                                y_qi, estimated_size );
+    }
 
-    if ( estimated_size <= target_size or ( y_qi_min == y_qi_max and best_y_qi == numeric_limits<uint8_t>::max() ) ) {
+    last_probe_qi = y_qi;
+    last_probe_size = estimated_size;
+
+    /* if not even the coarsest quantizer fits, it's the best we can do */
+    if ( estimated_size <= target_size or ( y_qi == y_qi_max and best_y_qi == numeric_limits<uint8_t>::max() ) ) {
       best_y_qi = y_qi;
+      best_estimated_size = estimated_size;
 
       y_qi_max = y_qi - 1;
     }
     else if ( estimated_size > target_size ) {
       y_qi_min = y_qi + 1;
     }
+
+    if ( use_rate_model ) {
+      bisect = not bisect and ( y_qi_max - y_qi_min ) > interval / 2;
+    }
+  }
+
+  /* the model follows the size estimates, since these are what the search
+     compares against the target size */
+  if ( not use_rate_model ) {
+    return encode_frame( raster, best_y_qi );
+  }
+
+  rate_model_.update( best_y_qi, best_estimated_size );
+
+  /* the estimates come from a subsampled frame, so the real size can still
+     overshoot. the mode decision is done once, and then only the
+     quantization is redone until the frame fits. */
+  const Optional<InterFrameHandle> analysis = analyze( raster, best_y_qi );
+  size_t size = requantized_size( raster, analysis, best_y_qi );
+
+  while ( size > target_size and best_y_qi < 127 ) {
+    best_y_qi = max( best_y_qi + 1,
+                     min( 127, rate_model_.predict( target_size, best_y_qi, size ) ) );
+    size = requantized_size( raster, analysis, best_y_qi );
+  }
+
+  if ( size_trimming_ ) {
+    /* the estimates tend to overshoot, which leaves room for a finer
+       quantizer. trimming starts from the finest one in the search range
+       that really fits, so that the step finer than it doesn't. */
+    if ( size <= target_size ) {
+      int fitting_qi = best_y_qi;
+      int overshooting_qi = y_qi_floor - 1;
+
+      while ( fitting_qi - overshooting_qi > 1 ) {
+        const int y_qi = ( fitting_qi + overshooting_qi ) / 2;
+
+        if ( requantized_size( raster, analysis, y_qi ) <= target_size ) {
+          fitting_qi = y_qi;
+        }
+        else {
+          overshooting_qi = y_qi;
+        }
+      }
+
+      best_y_qi = fitting_qi;
+    }
+
+    return encode_with_trimming( raster, analysis, best_y_qi, target_size );
   }
 
-  return encode_with_quantizer( raster, best_y_qi );
+  return encode_with_analysis( raster, analysis, best_y_qi );
+}
+
+Optional<InterFrameHandle> Encoder::analyze_frame( const VP8Raster & raster, const uint8_t y_ac_qi )
+{
+  if ( width() != raster.display_width() or height() != raster.display_height() ) {
+    throw runtime_error( "scaling is not supported" );
+  }
+
+  if ( scene_cut( raster ) ) {
+    force_key_frame();
+  }
+
+  return analyze( raster, y_ac_qi );
+}
+
+Optional<InterFrameHandle> Encoder::analyze( const VP8Raster & raster, const uint8_t y_ac_qi )
+{
+  if ( not has_state_ ) {
+    return {};
+  }
+
+  QuantIndices quant_indices;
+  quant_indices.y_ac_qi = y_ac_qi;
+  encode_raster<InterFrame>( raster, quant_indices );
+
+  /* the analysis keeps the frame, and the encoder gets a fresh one (but
+     with this header, whose probabilities seed the next frame's costs) */
+  Optional<InterFrameHandle> analysis { true, width(), height() };
+  swap( analysis.get(), inter_frame_ );
+  inter_frame_.get().mutable_header() = analysis.get().get().header();
+
+  return analysis;
+}
+
+size_t Encoder::requantized_size( const VP8Raster & raster,
+                                  const Optional<InterFrameHandle> & analysis,
+                                  const uint8_t y_ac_qi )
+{
+  if ( not analysis.initialized() ) {
+    return estimate_size<KeyFrame>( raster, y_ac_qi );
+  }
+
+  const InterFrame & frame = analysis.get().get();
+
+  if ( y_ac_qi == frame.header().quant_indices.y_ac_qi ) {
+    return frame.serialize( decoder_state_.probability_tables ).size();
+  }
+
+  return requantize( raster, frame, y_ac_qi, false ).serialize( decoder_state_.probability_tables ).size();
+}
+
+vector<uint8_t> Encoder::encode_with_analysis( const VP8Raster & raster,
+                                               const Optional<InterFrameHandle> & analysis,
+                                               const uint8_t y_ac_qi )
+{
+  if ( not analysis.initialized() ) {
+    force_key_frame();
+    return encode_frame( raster, y_ac_qi );
+  }
+
+  const InterFrame & frame = analysis.get().get();
+
+  if ( y_ac_qi == frame.header().quant_indices.y_ac_qi ) {
+    return write_frame( frame );
+  }
+
+  return write_frame( requantize( raster, frame, y_ac_qi, true ) );
+}
+
+vector<uint8_t> Encoder::encode_with_trimming( const VP8Raster & raster,
+                                               const Optional<InterFrameHandle> & analysis,
+                                               const uint8_t y_ac_qi,
+                                               const size_t target_size )
+{
+  if ( not analysis.initialized() or y_ac_qi == 0 ) {
+    return encode_with_analysis( raster, analysis, y_ac_qi );
+  }
+
+  const InterFrame & analyzed_frame = analysis.get().get();
+  const uint8_t fine_y_ac_qi = y_ac_qi - 1;
+
+  const InterFrame fine_frame = requantize( raster, analyzed_frame, fine_y_ac_qi, false );
+
+  if ( fine_frame.serialize( decoder_state_.probability_tables ).size() <= target_size ) {
+    return encode_with_analysis( raster, analysis, fine_y_ac_qi );
+  }
+
+  /* the macroblocks, most expensive (at the finer quantizer) first */
+  vector<pair<uint32_t, size_t>> macroblock_costs;
+  costs_.fill_token_costs( ProbabilityTables() );
+
+  fine_frame.macroblocks().forall_ij(
+    [&] ( const InterFrameMacroblock & frame_mb, const unsigned int mb_column, const unsigned int mb_row )
+    {
+      uint32_t cost = frame_mb.Y2().coded() ? costs_.block_cost( frame_mb.Y2() ) : 0;
+
+      frame_mb.Y().forall( [&] ( const YBlock & block ) { cost += costs_.block_cost( block ); } );
+      frame_mb.U().forall( [&] ( const UVBlock & block ) { cost += costs_.block_cost( block ); } );
+      frame_mb.V().forall( [&] ( const UVBlock & block ) { cost += costs_.block_cost( block ); } );
+
+      macroblock_costs.emplace_back( cost, mb_row * fine_frame.macroblocks().width() + mb_column );
+    }
+  );
+
+  sort( macroblock_costs.begin(), macroblock_costs.end(), greater<pair<uint32_t, size_t>>() );
+
+  auto keep_coarse = [&] ( const size_t count )
+    {
+      trim_map_.assign( macroblock_costs.size(), 0 );
+
+      for ( size_t i = 0; i < count; i++ ) {
+        trim_map_.at( macroblock_costs.at( i ).second ) = 1;
+      }
+    };
+
+  /* bisects the number of macroblocks that keep y_ac_qi, until the frame is
+     within the tolerance of the target size */
+  size_t fitting_count = macroblock_costs.size();
+  size_t overshooting_count = 0;
+  bool fits = false;
+
+  for ( unsigned int probe = 0;
+        probe < MAX_TRIM_PROBES and fitting_count - overshooting_count > 1;
+        probe++ ) {
+    const size_t count = ( fitting_count + overshooting_count ) / 2;
+    keep_coarse( count );
+
+    const size_t size = requantize( raster, analyzed_frame, fine_y_ac_qi, false )
+                        .serialize( decoder_state_.probability_tables ).size();
+
+    if ( size > target_size ) {
+      overshooting_count = count;
+      continue;
+    }
+
+    fitting_count = count;
+    fits = true;
+
+    if ( target_size - size <= TRIM_TOLERANCE * target_size ) {
+      break;
+    }
+  }
+
+  if ( not fits ) {
+    trim_map_.clear();
+    return encode_with_analysis( raster, analysis, y_ac_qi );
+  }
+
+  keep_coarse( fitting_count );
+  vector<uint8_t> output = write_frame( requantize( raster, analyzed_frame, fine_y_ac_qi, true ) );
+  trim_map_.clear();
+
+  return output;
+}
+
+vector<uint8_t> Encoder::encode_repeat_frame()
+{
+  if ( not has_state_ ) {
+    throw runtime_error( "there is no frame to repeat" );
+  }
+
+  /* an intra-refresh stripe or a pending golden refresh would make this
+     frame more than a copy; they wait for the next real frame */
+  const uint16_t intra_refresh_period = intra_refresh_period_;
+  const bool refresh_golden = refresh_golden_;
+  const Optional<uint8_t> loop_filter_level = loop_filter_level_;
+  const Optional<uint8_t> last_y_ac_qi = last_y_ac_qi_;
+
+  intra_refresh_period_ = 0;
+  refresh_golden_ = false;
+
+  /* predicted from the last frame itself, every macroblock ends up with a
+     zero motion vector and no residual */
+  QuantIndices quant_indices;
+  quant_indices.y_ac_qi = 127;
+
+  const RasterHandle last = references_.last;
+  InterFrame & frame = encode_raster<InterFrame>( last, quant_indices ).first;
+
+  /* nothing else depends on this frame, whatever its temporal layer */
+  frame.mutable_header().refresh_last = false;
+  frame.mutable_header().refresh_golden_frame = false;
+  frame.mutable_header().copy_buffer_to_golden.reset( 0 );
+  frame.mutable_header().refresh_entropy_probs = false;
+  frame.mutable_header().loop_filter_level = 0;
+
+  const uint8_t temporal_position = temporal_position_;
+  vector<uint8_t> output = write_frame( frame );
+  temporal_position_ = temporal_position;
+
+  intra_refresh_period_ = intra_refresh_period;
+  refresh_golden_ = refresh_golden;
+  loop_filter_level_ = loop_filter_level;
+  last_y_ac_qi_ = last_y_ac_qi;
+
+  return output;
 }
 
 template <class FrameHeaderType, class MacroblockHeaderType>
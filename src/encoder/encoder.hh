@@ -40,6 +40,8 @@
 #include "vp8_raster.hh"
 #include "ivf_writer.hh"
 #include "costs.hh"
+#include "rate_model.hh"
+#include "two_pass.hh"
 #include "enc_state_serializer.hh"
 #include "file_descriptor.hh"
 #include "block.hh"
@@ -59,11 +61,35 @@ enum EncoderQuality
   REALTIME_QUALITY
 };
 
+/* the distortion that prediction candidates are ranked by */
+enum DistortionMetric
+{
+  PIXEL_DISTORTION, /* SSE, SAD or variance of the residual */
+  SATD_DISTORTION   /* Hadamard-transformed residual */
+};
+
+/* how much of the inter prediction space is searched for each macroblock */
+enum InterSearchEffort
+{
+  LAST_FRAME_SEARCH,     /* whole-macroblock modes against LAST_FRAME */
+  ALL_REFERENCES_SEARCH, /* ... against LAST_FRAME, GOLDEN_FRAME and ALTREF_FRAME */
+  SPLITMV_SEARCH,        /* ... plus SPLITMV with 16x8, 8x16 and 8x8 partitions */
+  FULL_SPLITMV_SEARCH    /* ... plus SPLITMV with 4x4 partitions */
+};
+
+/* which blocks trellis quantization (in the second pass) is applied to */
+enum TrellisScope
+{
+  TRELLIS_ALL_CANDIDATES, /* every block quantized, including during mode decision */
+  TRELLIS_FINAL_MODE      /* only the blocks of the mode finally chosen */
+};
+
 enum EncoderMode
 {
   MINIMUM_SSIM,
   CONSTANT_QUANTIZER,
   TARGET_FRAME_SIZE,
+  CONSTANT_BITRATE,
   REENCODE
 };
 
@@ -111,6 +137,16 @@ private:
     size_t first_step;
   };
 
+  struct SplitMVSearchResult
+  {
+    MBPredictionData pred {};
+    uint8_t partition_id { 0 };
+
+    /* per subblock, indexed by column + 4 * row */
+    SafeArray<bmode, 16> modes {};
+    SafeArray<MotionVector, 16> mvs {};
+  };
+
   static const size_t WIDTH_SAMPLE_DIMENSION_FACTOR { 4 };
   static const size_t HEIGHT_SAMPLE_DIMENSION_FACTOR { 4 };
 
@@ -132,6 +168,71 @@ private:
   bool two_pass_encoder_;
   EncoderQuality encode_quality_;
 
+  /* how many subblock prediction modes are fully evaluated for each B_PRED
+     subblock. if this is less than num_intra_b_modes, the directional modes
+     are ranked by an edge-direction estimate and only the best ones are
+     tried (B_DC_PRED and B_TM_PRED are always tried). */
+  uint8_t bpred_candidates_ { num_intra_b_modes };
+
+  DistortionMetric distortion_metric_ { PIXEL_DISTORTION };
+
+  InterSearchEffort inter_search_effort_ { LAST_FRAME_SEARCH };
+
+  /* trellis quantization tries this many levels for each coefficient:
+     the truncated quotient, one below it, the rounded-up quotient and
+     two below it, in that order */
+  static constexpr uint8_t MAX_TRELLIS_LEVELS = 4;
+  uint8_t trellis_levels_ { 2 };
+  TrellisScope trellis_scope_ { TRELLIS_ALL_CANDIDATES };
+
+  /* if set, the next inter frame also replaces the golden reference */
+  bool refresh_golden_ { false };
+
+  /* intra refresh: the macroblock columns are split into this many stripes,
+     and each inter frame intra-codes the next one (0 means off) */
+  uint16_t intra_refresh_period_ { 0 };
+  uint16_t intra_refresh_position_ { 0 };
+
+  /* how many quantizers encode_with_quantizer_search tries at the same time
+     (0 means one per hardware thread). one by default, since the caller may
+     already be running several encoders at once. */
+  unsigned int quantizer_search_threads_ { 1 };
+
+  /* how many macroblock rows the re-encoding and requantizing paths work on
+     at the same time, in a wavefront (0 means one per hardware thread) */
+  unsigned int wavefront_threads_ { 1 };
+
+  /* the DCT tokens are split between 1 << log2_dct_partitions_ partitions */
+  uint8_t log2_dct_partitions_ { 0 };
+
+  /* adaptive quantization: flat macroblocks get a quantizer index this much
+     finer, and busy ones this much coarser (0 means off) */
+  uint8_t aq_strength_ { 0 };
+
+  /* region of interest: macroblocks with a nonzero entry (in raster order)
+     get a quantizer index roi_qi_delta_ finer (empty means off) */
+  std::vector<uint8_t> roi_map_ {};
+  uint8_t roi_qi_delta_ { 0 };
+
+  /* size trimming: once encode_with_target_size has found the quantizer,
+     the frame is made a step finer except for the most expensive
+     macroblocks (those in trim_map_, which get a segment of their own), as
+     many of them as it takes to fit */
+  static constexpr unsigned int MAX_TRIM_PROBES = 6;
+  static constexpr double TRIM_TOLERANCE = 0.02;
+  bool size_trimming_ { false };
+  std::vector<uint8_t> trim_map_ {};
+
+  /* if set, an inter frame that starts a new scene is made a keyframe */
+  bool detect_scene_cuts_ { false };
+  unsigned int frames_since_key_frame_ { 0 };
+
+  /* temporal scalability: the frames cycle through this many layers (1
+     means off), and temporal_position_ is the next frame's place in the
+     cycle */
+  uint8_t temporal_layers_ { 1 };
+  uint8_t temporal_position_ { 0 };
+
   KeyFrameHandle key_frame_ { width(), height() };
   KeyFrameHandle subsampled_key_frame_ { uint16_t( width() / WIDTH_SAMPLE_DIMENSION_FACTOR ),
       uint16_t( height() / HEIGHT_SAMPLE_DIMENSION_FACTOR ),
@@ -148,6 +249,9 @@ private:
      last_y_ac_qi_ - a <= y_ac_qi <= last_y_ac_qi_ + a */
   Optional<uint8_t> last_y_ac_qi_ {};
 
+  /* predicts the quantizer for a target size from the previous inter frames */
+  RateModel rate_model_ {};
+
   // TODO: Where did these come from?
   uint32_t RATE_MULTIPLIER { 300 };
   uint32_t DISTORTION_MULTIPLIER { 1 };
@@ -174,6 +278,33 @@ private:
   static uint32_t variance( const VP8Raster::Block<size> & block,
                             const TwoDSubRange<uint8_t, size, size> & prediction );
 
+  template<unsigned int size>
+  static uint32_t satd( const VP8Raster::Block<size> & block,
+                        const TwoDSubRange<uint8_t, size, size> & prediction );
+
+  /* SATD, brought to the scale of SSE so that it can be traded off against
+     the same rate multipliers */
+  template<unsigned int size>
+  static uint32_t satd_distortion( const VP8Raster::Block<size> & block,
+                                   const TwoDSubRange<uint8_t, size, size> & prediction );
+
+  /* residual, forward DCT and quantization of all the luma (or chroma)
+     subblocks of a macroblock at once, against the prediction in
+     prediction_mb. Without factors, the coefficients are left unquantized
+     (for trellis quantization); with walsh_input, the luma DCs are moved
+     there for the Y2 block. */
+  static void luma_mb_subtract_dct_quantize( const VP8Raster::Macroblock & original_mb,
+                                             const VP8Raster::Macroblock & prediction_mb,
+                                             TwoDSubRange<YBlock, 4, 4> & blocks,
+                                             const Optional<std::pair<uint16_t, uint16_t>> & factors,
+                                             SafeArray<int16_t, 16> * walsh_input = nullptr );
+
+  static void chroma_mb_subtract_dct_quantize( const VP8Raster::Macroblock & original_mb,
+                                               const VP8Raster::Macroblock & prediction_mb,
+                                               TwoDSubRange<UVBlock, 2, 2> & u_blocks,
+                                               TwoDSubRange<UVBlock, 2, 2> & v_blocks,
+                                               const Optional<std::pair<uint16_t, uint16_t>> & factors );
+
   MVSearchResult diamond_search( const VP8Raster::Macroblock & original_mb,
                                  VP8Raster::Macroblock & temp_mb,
                                  InterFrameMacroblock & frame_mb,
@@ -191,7 +322,15 @@ private:
                               const Quantizer & quantizer,
                               MVComponentCounts & component_counts,
                               const size_t y_ac_qi,
-                              const EncoderPass encoder_pass );
+                              const EncoderPass encoder_pass,
+                              const bool intra_only = false );
+
+  SplitMVSearchResult luma_mb_split_predict( const VP8Raster::Macroblock & original_mb,
+                                             VP8Raster::Macroblock & temp_mb,
+                                             InterFrameMacroblock & frame_mb,
+                                             const VP8Raster & reference,
+                                             const MotionVector & best_ref,
+                                             const MotionVector & start_mv ) const;
 
   void luma_mb_apply_inter_prediction( const VP8Raster::Macroblock & original_mb,
                                        VP8Raster::Macroblock & reconstructed_mb,
@@ -283,6 +422,14 @@ private:
                                        VP8Raster & reconstructed,
                                        FrameType & frame );
 
+  /* picks a filter level by filtering a sample of the macroblocks and
+     comparing them to the original with SSE, instead of filtering the whole
+     frame and computing SSIM for every level */
+  template<class FrameType>
+  uint8_t estimate_best_loopfilter_level( const VP8Raster & original,
+                                          const VP8Raster & reconstructed,
+                                          FrameType & frame );
+
   template<class FrameType>
   void optimize_probability_tables( FrameType & frame, const TokenBranchCounts & token_branch_counts );
 
@@ -320,6 +467,29 @@ private:
                                 const QuantIndices & quant_indices,
                                 const bool last_frame );
 
+  /* quantizes an analyzed frame at y_ac_qi: the modes, references and
+     motion vectors stay, but the residues and probabilities are redone */
+  InterFrame requantize( const VP8Raster & original_raster,
+                         const InterFrame & analysis,
+                         const uint8_t y_ac_qi,
+                         const bool choose_loop_filter );
+
+  /* calls f( mb_column, mb_row ) for each macroblock. the rows are dealt out
+     to wavefront_threads_ threads, and a macroblock waits for the one above
+     and to the right of it, the last one that its intra prediction and
+     token contexts look at. */
+  template<class Function>
+  void forall_macroblocks_wavefront( const Function & f ) const;
+
+  /* update_macroblock for an intra-coded macroblock (of either frame type) */
+  template<class MacroblockType>
+  void update_intra_macroblock( const VP8Raster::Macroblock & original_rmb,
+                                VP8Raster::Macroblock & reconstructed_rmb,
+                                VP8Raster::Macroblock & temp_mb,
+                                MacroblockType & frame_mb,
+                                const MacroblockType & original_fmb,
+                                const Quantizer & quantizer );
+
   void update_macroblock( const VP8Raster::Macroblock & original_rmb,
                           VP8Raster::Macroblock & reconstructed_rmb,
                           VP8Raster::Macroblock & temp_mb,
@@ -330,6 +500,10 @@ private:
   template<class FrameType>
   void update_decoder_state( const FrameType & frame );
 
+  /* copies the segment of each macroblock to the decoder state's map */
+  template<class FrameType>
+  void update_segmentation_map( const FrameType & frame );
+
   template<class FrameType>
   std::pair<FrameType &, double> encode_raster( const VP8Raster & raster,
                                                 const QuantIndices & quant_indices,
@@ -340,8 +514,31 @@ private:
   FrameType & encode_with_quantizer_search( const VP8Raster & raster,
                                             const double minimum_ssim );
 
+  /* encode_with_analysis, but the most expensive macroblocks keep y_ac_qi
+     while the rest get a step finer, if that still fits target_size */
+  std::vector<uint8_t> encode_with_trimming( const VP8Raster & raster,
+                                             const Optional<InterFrameHandle> & analysis,
+                                             const uint8_t y_ac_qi,
+                                             const size_t target_size );
+
+  /* analyze_frame without the scene-cut check */
+  Optional<InterFrameHandle> analyze( const VP8Raster & raster, const uint8_t y_ac_qi );
+
+  /* a keyframe if there's no state yet, an inter frame otherwise */
+  std::vector<uint8_t> encode_frame( const VP8Raster & raster, const uint8_t y_ac_qi );
+
   void update_rd_multipliers( const Quantizer & quantizer );
 
+  /* puts the macroblocks in segments by their activity and the region of
+     interest, and returns the quantizer indices of each segment */
+  template<class FrameType>
+  SafeArray<QuantIndices, num_segments> assign_segments( const VP8Raster & raster,
+                                                         FrameType & frame ) const;
+
+  /* compares the estimated sizes of the frame as a keyframe and as an inter
+     frame (if scene-cut detection is on) */
+  bool scene_cut( const VP8Raster & raster );
+
 public:
   Encoder( const uint16_t s_width, const uint16_t s_height,
            const bool two_pass,
@@ -367,7 +564,38 @@ public:
   std::vector<uint8_t> encode_with_target_size( const VP8Raster & raster,
                                                 const size_t target_size );
 
-  void reencode( const std::vector<RasterHandle> & original_rasters,
+  /* Runs the mode decision for the raster once (at y_ac_qi), so that
+   * requantized_size and encode_with_analysis can quantize it at other
+   * quantizers without searching again. There's no analysis of a frame
+   * that will be a keyframe. */
+  Optional<InterFrameHandle> analyze_frame( const VP8Raster & raster,
+                                            const uint8_t y_ac_qi );
+
+  size_t requantized_size( const VP8Raster & raster,
+                           const Optional<InterFrameHandle> & analysis,
+                           const uint8_t y_ac_qi );
+
+  std::vector<uint8_t> encode_with_analysis( const VP8Raster & raster,
+                                             const Optional<InterFrameHandle> & analysis,
+                                             const uint8_t y_ac_qi );
+
+  /* An inter frame that shows the last frame again and changes no
+   * reference, to stand in for a dropped frame. */
+  std::vector<uint8_t> encode_repeat_frame();
+
+  /* Transcoding: quantizes a frame of another stream again at y_ac_qi,
+   * keeping its modes, references, motion vectors and partitioning. The
+   * residues are taken against this encoder's own references, so the
+   * requantization error doesn't build up from frame to frame. */
+  std::vector<uint8_t> transcode( const VP8Raster & raster,
+                                  const KeyFrame & original_frame,
+                                  const uint8_t y_ac_qi );
+
+  std::vector<uint8_t> transcode( const VP8Raster & raster,
+                                  const InterFrame & original_frame,
+                                  const uint8_t y_ac_qi );
+
+  void reencode( FrameInput & original_rasters,
                  const std::vector<std::pair<Optional<KeyFrame>, Optional<InterFrame> > > & prediction_frames,
                  const double kf_q_weight,
                  const bool extra_frame_chunk,
@@ -375,6 +603,71 @@ public:
 
   size_t estimate_frame_size( const VP8Raster & raster, const size_t y_ac_qi );
 
+  /* estimates the frame's size at y_ac_qi both as a keyframe and as an
+     inter frame, then takes the frame itself as the reference for the next
+     one (nothing is encoded) */
+  FirstPassStats first_pass( const RasterHandle & raster, const uint8_t y_ac_qi );
+
+  /* makes the next encoded frame a keyframe */
+  void force_key_frame() { has_state_ = false; }
+
+  /* makes the next frame a keyframe if it starts a new scene (with
+     scene-cut detection on), and returns whether it will be one */
+  bool decide_key_frame( const VP8Raster & raster );
+
+  void set_scene_cut_detection( const bool detect ) { detect_scene_cuts_ = detect; }
+
+  /* limits the number of subblock modes fully evaluated for B_PRED
+     (num_intra_b_modes means exhaustive search) */
+  void set_bpred_candidates( const uint8_t candidates );
+
+  void set_distortion_metric( const DistortionMetric metric ) { distortion_metric_ = metric; }
+
+  void set_inter_search_effort( const InterSearchEffort effort ) { inter_search_effort_ = effort; }
+
+  /* candidate levels per coefficient for trellis quantization, 1-4 */
+  void set_trellis_levels( const uint8_t levels );
+
+  void set_trellis_scope( const TrellisScope scope ) { trellis_scope_ = scope; }
+
+  /* makes the next encoded inter frame refresh GOLDEN_FRAME (one-shot) */
+  void set_refresh_golden( const bool refresh ) { refresh_golden_ = refresh; }
+
+  /* the whole picture is intra-coded over the course of this many inter
+     frames, one column stripe per frame (0 disables intra refresh) */
+  void set_intra_refresh_period( const uint16_t frames )
+  {
+    intra_refresh_period_ = frames;
+    intra_refresh_position_ = 0;
+  }
+
+  /* 1 (off), 2 or 3 temporal layers. a frame above the base layer
+     predicts only from lower layers and updates neither the references it
+     doesn't own nor the entropy probabilities, so the top layers can be
+     dropped without breaking the ones below. */
+  void set_temporal_layers( const uint8_t layers );
+
+  /* the temporal layer of the next frame (0 is the base layer) */
+  uint8_t temporal_layer() const;
+
+  /* encode_with_target_size spends what the quantizer step leaves of the
+     target size on the cheaper macroblocks (slower) */
+  void set_size_trimming( const bool trimming ) { size_trimming_ = trimming; }
+
+  void set_aq_strength( const uint8_t strength ) { aq_strength_ = strength; }
+
+  /* one entry per macroblock, in raster order (an empty map turns the
+     region of interest off) */
+  void set_roi_map( const std::vector<uint8_t> & map, const uint8_t qi_delta );
+
+  void set_quantizer_search_threads( const unsigned int threads ) { quantizer_search_threads_ = threads; }
+
+  void set_wavefront_threads( const unsigned int threads ) { wavefront_threads_ = threads; }
+
+  /* number of DCT token partitions (1, 2, 4 or 8), interleaved by
+     macroblock row and serialized in parallel */
+  void set_dct_partitions( const uint8_t count );
+
   Decoder export_decoder() const { return { decoder_state_, references_ }; }
 
   EncodeStats stats() { return encode_stats_; }
@@ -0,0 +1,82 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <algorithm>
+#include <cmath>
+
+#include "rate_model.hh"
+
+using namespace std;
+
+static double log_size( const size_t size )
+{
+  return log( max( size, static_cast<size_t>( 1 ) ) );
+}
+
+int RateModel::predict( const double intercept, const size_t target_size ) const
+{
+  return lround( ( intercept - log_size( target_size ) ) / slope_ );
+}
+
+int RateModel::predict( const size_t target_size ) const
+{
+  return predict( intercept_.get(), target_size );
+}
+
+int RateModel::predict( const size_t target_size,
+                        const size_t y_ac_qi, const size_t size ) const
+{
+  return predict( log_size( size ) + slope_ * y_ac_qi, target_size );
+}
+
+void RateModel::update_slope( const size_t y_ac_qi_1, const size_t size_1,
+                              const size_t y_ac_qi_2, const size_t size_2 )
+{
+  if ( y_ac_qi_1 == y_ac_qi_2 ) {
+    return;
+  }
+
+  const double slope = ( log_size( size_1 ) - log_size( size_2 ) )
+                       / ( static_cast<double>( y_ac_qi_2 ) - y_ac_qi_1 );
+
+  /* the sizes are estimates and can be noisy; don't let a single pair
+     throw the model off */
+  slope_ = 0.5 * slope_ + 0.5 * min( 0.2, max( 0.005, slope ) );
+}
+
+void RateModel::update( const size_t y_ac_qi, const size_t size )
+{
+  const double intercept = log_size( size ) + slope_ * y_ac_qi;
+
+  if ( intercept_.initialized() ) {
+    intercept_.reset( 0.5 * intercept_.get() + 0.5 * intercept );
+  }
+  else {
+    intercept_.reset( intercept );
+  }
+}
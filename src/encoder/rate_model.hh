@@ -0,0 +1,66 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef RATE_MODEL_HH
+#define RATE_MODEL_HH
+
+#include <cstddef>
+
+#include "optional.hh"
+
+/* an exponential model of the frame size against y_ac_qi, i.e.
+   log( size ) = intercept - slope * y_ac_qi, that follows a stream. the
+   slope is learned from pairs of sizes of the same frame, and the intercept
+   from the size of the last frame. */
+class RateModel
+{
+private:
+  double slope_ { 0.03 };
+  Optional<double> intercept_ {};
+
+  int predict( const double intercept, const size_t target_size ) const;
+
+public:
+  bool ready() const { return intercept_.initialized(); }
+
+  /* the y_ac_qi expected to give a frame of target_size */
+  int predict( const size_t target_size ) const;
+
+  /* same, but anchored at a known size of the current frame */
+  int predict( const size_t target_size,
+               const size_t y_ac_qi, const size_t size ) const;
+
+  /* two sizes of the same frame at different quantizers */
+  void update_slope( const size_t y_ac_qi_1, const size_t size_1,
+                     const size_t y_ac_qi_2, const size_t size_2 );
+
+  /* the size of a frame that was just encoded */
+  void update( const size_t y_ac_qi, const size_t size );
+};
+
+#endif /* RATE_MODEL_HH */
@@ -26,14 +26,103 @@
    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
-#include <limits>
+#include <atomic>
 #include <cmath>
+#include <future>
+#include <limits>
+#include <thread>
 
 #include "encoder.hh"
 #include "scorer.hh"
 
 using namespace std;
 
+template<class Function>
+void Encoder::forall_macroblocks_wavefront( const Function & f ) const
+{
+  const unsigned int mb_width = VP8Raster::macroblock_dimension( width() );
+  const unsigned int mb_height = VP8Raster::macroblock_dimension( height() );
+
+  const unsigned int thread_count = min( mb_height, ( wavefront_threads_ > 0 )
+                                                    ? wavefront_threads_
+                                                    : max( 1u, thread::hardware_concurrency() ) );
+
+  if ( thread_count <= 1 ) {
+    for ( unsigned int mb_row = 0; mb_row < mb_height; mb_row++ ) {
+      for ( unsigned int mb_column = 0; mb_column < mb_width; mb_column++ ) {
+        f( mb_column, mb_row );
+      }
+    }
+
+    return;
+  }
+
+  /* how many macroblocks of each row are done */
+  vector<atomic<unsigned int>> done( mb_height );
+  for ( auto & count : done ) {
+    count.store( 0 );
+  }
+
+  /* a thread that throws lets the others stop waiting for its rows */
+  atomic<bool> failed { false };
+
+  auto process_rows =
+    [&] ( const unsigned int first_row )
+    {
+      try {
+        for ( unsigned int mb_row = first_row; mb_row < mb_height; mb_row += thread_count ) {
+          for ( unsigned int mb_column = 0; mb_column < mb_width; mb_column++ ) {
+            const unsigned int needed = min( mb_column + 2, mb_width );
+
+            while ( mb_row > 0 and done[ mb_row - 1 ].load( memory_order_acquire ) < needed ) {
+              if ( failed ) {
+                return;
+              }
+
+              this_thread::yield();
+            }
+
+            f( mb_column, mb_row );
+            done[ mb_row ].store( mb_column + 1, memory_order_release );
+          }
+        }
+      }
+      catch ( ... ) {
+        failed = true;
+        throw;
+      }
+    };
+
+  vector<future<void>> workers;
+
+  for ( unsigned int i = 0; i < thread_count; i++ ) {
+    workers.push_back( async( launch::async, process_rows, i ) );
+  }
+
+  for ( auto & worker : workers ) {
+    worker.get();
+  }
+}
+
+/* adds up the token branches of the macroblock rows, which are counted apart
+   so that the rows can be processed at the same time */
+static void sum_token_branches( const vector<TokenBranchCounts> & row_counts,
+                                TokenBranchCounts & token_branch_counts )
+{
+  for ( const TokenBranchCounts & counts : row_counts ) {
+    for ( unsigned int i = 0; i < BLOCK_TYPES; i++ ) {
+      for ( unsigned int j = 0; j < COEF_BANDS; j++ ) {
+        for ( unsigned int k = 0; k < PREV_COEF_CONTEXTS; k++ ) {
+          for ( unsigned int l = 0; l < ENTROPY_NODES; l++ ) {
+            token_branch_counts.at( i ).at( j ).at( k ).at( l ).first += counts.at( i ).at( j ).at( k ).at( l ).first;
+            token_branch_counts.at( i ).at( j ).at( k ).at( l ).second += counts.at( i ).at( j ).at( k ).at( l ).second;
+          }
+        }
+      }
+    }
+  }
+}
+
 template<class FrameType>
 InterFrame Encoder::reencode_as_interframe( const VP8Raster & original_raster,
                                             const FrameType & original_frame,
@@ -44,12 +133,7 @@ InterFrame Encoder::reencode_as_interframe( const VP8Raster & original_raster,
   auto & kf_header = original_frame.header();
   auto & if_header = frame.mutable_header();
 
-  if ( kf_header.update_segmentation.initialized() ) {
-    throw Unsupported( "segmentation not supported" );
-  }
-
   if_header.filter_type             = kf_header.filter_type;
-  if_header.update_segmentation     = kf_header.update_segmentation;
   if_header.loop_filter_level       = kf_header.loop_filter_level;
   if_header.sharpness_level         = kf_header.sharpness_level;
   if_header.mode_lf_adjustments     = kf_header.mode_lf_adjustments;
@@ -72,7 +156,10 @@ InterFrame Encoder::reencode_as_interframe( const VP8Raster & original_raster,
     if_header.intra_chroma_prob.get().at( i ) = k_default_uv_mode_probs.at( i );
   }
 
-  Quantizer quantizer( frame.header().quant_indices );
+  /* the segments are assigned anew, since the keyframe's segment map
+     doesn't carry over to an interframe that doesn't code its own */
+  const auto segment_indices = assign_segments( original_raster, frame );
+
   MutableRasterHandle reconstructed_raster_handle { width(), height() };
   VP8Raster & reconstructed_raster = reconstructed_raster_handle.get();
 
@@ -90,10 +177,13 @@ InterFrame Encoder::reencode_as_interframe( const VP8Raster & original_raster,
       auto temp_mb = temp_raster().macroblock( mb_column, mb_row );
       auto & frame_mb = frame.mutable_macroblocks().at( mb_column, mb_row );
 
+      const QuantIndices & mb_quant_indices = segment_indices.at( frame_mb.segment_id() );
+      const Quantizer quantizer( mb_quant_indices );
+
       // Process Y and Y2
       luma_mb_inter_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
                              frame_mb, quantizer, component_counts,
-                             frame.header().quant_indices.y_ac_qi, FIRST_PASS );
+                             mb_quant_indices.y_ac_qi, FIRST_PASS );
 
       if ( frame_mb.inter_coded() ) {
         chroma_mb_inter_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
@@ -128,18 +218,15 @@ InterFrame Encoder::reencode_as_interframe( const VP8Raster & original_raster,
   return frame;
 }
 
-void Encoder::update_macroblock( const VP8Raster::Macroblock & original_mb,
-                                 VP8Raster::Macroblock & reconstructed_mb,
-                                 VP8Raster::Macroblock & temp_mb,
-                                 InterFrameMacroblock & frame_mb,
-                                 const InterFrameMacroblock & original_fmb,
-                                 const Quantizer & quantizer )
+template<class MacroblockType>
+void Encoder::update_intra_macroblock( const VP8Raster::Macroblock & original_mb,
+                                       VP8Raster::Macroblock & reconstructed_mb,
+                                       VP8Raster::Macroblock & temp_mb,
+                                       MacroblockType & frame_mb,
+                                       const MacroblockType & original_fmb,
+                                       const Quantizer & quantizer )
 {
-  frame_mb.mutable_header() = original_fmb.header();
-
-  mbmode luma_pred_mode = original_fmb.y_prediction_mode();
-
-  MotionVector best_mv;
+  const mbmode luma_pred_mode = original_fmb.y_prediction_mode();
 
   switch( luma_pred_mode ) {
   case DC_PRED:
@@ -167,6 +254,47 @@ void Encoder::update_macroblock( const VP8Raster::Macroblock & original_mb,
 
     break;
 
+  default:
+    throw Unsupported( "unsupported prediction mode" );
+  }
+
+  luma_mb_apply_intra_prediction( original_mb, reconstructed_mb, temp_mb,
+                                  frame_mb, quantizer, luma_pred_mode,
+                                  FIRST_PASS );
+
+  mbmode chroma_pred_mode = original_fmb.uv_prediction_mode();
+
+  reconstructed_mb.U.intra_predict( chroma_pred_mode );
+  reconstructed_mb.V.intra_predict( chroma_pred_mode );
+
+  chroma_mb_apply_intra_prediction( original_mb, reconstructed_mb, temp_mb,
+                                    frame_mb, quantizer, chroma_pred_mode,
+                                    FIRST_PASS );
+
+  frame_mb.calculate_has_nonzero();
+  frame_mb.reconstruct_intra( quantizer, reconstructed_mb );
+}
+
+void Encoder::update_macroblock( const VP8Raster::Macroblock & original_mb,
+                                 VP8Raster::Macroblock & reconstructed_mb,
+                                 VP8Raster::Macroblock & temp_mb,
+                                 InterFrameMacroblock & frame_mb,
+                                 const InterFrameMacroblock & original_fmb,
+                                 const Quantizer & quantizer )
+{
+  frame_mb.mutable_header() = original_fmb.header();
+
+  if ( not frame_mb.inter_coded() ) {
+    update_intra_macroblock( original_mb, reconstructed_mb, temp_mb, frame_mb,
+                             original_fmb, quantizer );
+    return;
+  }
+
+  mbmode luma_pred_mode = original_fmb.y_prediction_mode();
+
+  MotionVector best_mv;
+
+  switch( luma_pred_mode ) {
   case NEARESTMV:
   case NEARMV:
   case ZEROMV:
@@ -203,34 +331,15 @@ void Encoder::update_macroblock( const VP8Raster::Macroblock & original_mb,
     throw Unsupported( "unsupported prediction mode" );
   }
 
-  if ( frame_mb.inter_coded() ) {
-    luma_mb_apply_inter_prediction( original_mb, reconstructed_mb,
-                                    frame_mb, quantizer, luma_pred_mode,
-                                    best_mv );
-
-    chroma_mb_inter_predict( original_mb, reconstructed_mb, temp_mb,
-                             frame_mb, quantizer, FIRST_PASS );
-
-    frame_mb.calculate_has_nonzero();
-    frame_mb.reconstruct_inter( quantizer, references_, reconstructed_mb );
-  }
-  else {
-    luma_mb_apply_intra_prediction( original_mb, reconstructed_mb, temp_mb,
-                                    frame_mb, quantizer, luma_pred_mode,
-                                    FIRST_PASS );
-
-    mbmode chroma_pred_mode = original_fmb.uv_prediction_mode();
-
-    reconstructed_mb.U.intra_predict( chroma_pred_mode );
-    reconstructed_mb.V.intra_predict( chroma_pred_mode );
+  luma_mb_apply_inter_prediction( original_mb, reconstructed_mb,
+                                  frame_mb, quantizer, luma_pred_mode,
+                                  best_mv );
 
-    chroma_mb_apply_intra_prediction( original_mb, reconstructed_mb, temp_mb,
-                                      frame_mb, quantizer, chroma_pred_mode,
-                                      FIRST_PASS );
+  chroma_mb_inter_predict( original_mb, reconstructed_mb, temp_mb,
+                           frame_mb, quantizer, FIRST_PASS );
 
-    frame_mb.calculate_has_nonzero();
-    frame_mb.reconstruct_intra( quantizer, reconstructed_mb );
-  }
+  frame_mb.calculate_has_nonzero();
+  frame_mb.reconstruct_inter( quantizer, references_, reconstructed_mb );
 }
 
 InterFrame Encoder::update_residues( const VP8Raster & original_raster,
@@ -243,7 +352,6 @@ InterFrame Encoder::update_residues( const VP8Raster & original_raster,
   const InterFrameHeader & of_header = original_frame.header();
   InterFrameHeader & if_header = frame.mutable_header();
 
-  if_header.update_segmentation      = of_header.update_segmentation;
   if_header.filter_type              = of_header.filter_type;
   if_header.loop_filter_level        = of_header.loop_filter_level;
   if_header.sharpness_level          = of_header.sharpness_level;
@@ -271,28 +379,37 @@ InterFrame Encoder::update_residues( const VP8Raster & original_raster,
 
   if_header.quant_indices = quant_indices;
 
-  Quantizer quantizer( frame.header().quant_indices );
+  /* the macroblocks keep their segments only if they're assigned the same
+     way as in the original frame, so they are assigned (and coded) anew */
+  const auto segment_indices = assign_segments( original_raster, frame );
+
   MutableRasterHandle reconstructed_raster_handle { width(), height() };
   VP8Raster & reconstructed_raster = reconstructed_raster_handle.get();
 
   TokenBranchCounts token_branch_counts;
+  vector<TokenBranchCounts> row_counts( VP8Raster::macroblock_dimension( height() ) );
 
-  original_raster.macroblocks_forall_ij(
-    [&] ( VP8Raster::ConstMacroblock original_mb, unsigned int mb_column, unsigned int mb_row )
+  forall_macroblocks_wavefront(
+    [&] ( const unsigned int mb_column, const unsigned int mb_row )
     {
+      const auto original_mb = original_raster.macroblock( mb_column, mb_row );
       auto reconstructed_mb = reconstructed_raster.macroblock( mb_column, mb_row );
       auto temp_mb = temp_raster().macroblock( mb_column, mb_row );
       auto & original_fmb = original_frame.macroblocks().at( mb_column, mb_row );
       auto & frame_mb = frame.mutable_macroblocks().at( mb_column, mb_row );
 
+      const Quantizer quantizer( segment_indices.at( frame_mb.segment_id() ) );
+
       update_macroblock( original_mb.macroblock(), reconstructed_mb, temp_mb, frame_mb,
                          original_fmb, quantizer );
 
       frame_mb.calculate_has_nonzero();
-      frame_mb.accumulate_token_branches( token_branch_counts );
+      frame_mb.accumulate_token_branches( row_counts.at( mb_row ) );
     }
   );
 
+  sum_token_branches( row_counts, token_branch_counts );
+
   frame.relink_y2_blocks();
 
   optimize_prob_skip( frame );
@@ -302,24 +419,176 @@ InterFrame Encoder::update_residues( const VP8Raster & original_raster,
   return frame;
 }
 
-void Encoder::reencode( const vector<RasterHandle> & original_rasters,
+/* a frame whose header is copied from another one keeps that frame's
+   token probability updates, unless the new counts replace them */
+template<class FrameHeaderType>
+static void clear_token_prob_updates( FrameHeaderType & header )
+{
+  for ( unsigned int i = 0; i < BLOCK_TYPES; i++ ) {
+    for ( unsigned int j = 0; j < COEF_BANDS; j++ ) {
+      for ( unsigned int k = 0; k < PREV_COEF_CONTEXTS; k++ ) {
+        for ( unsigned int l = 0; l < ENTROPY_NODES; l++ ) {
+          header.token_prob_update.at( i ).at( j ).at( k ).at( l ) = TokenProbUpdate();
+        }
+      }
+    }
+  }
+}
+
+InterFrame Encoder::requantize( const VP8Raster & original_raster,
+                                const InterFrame & analysis,
+                                const uint8_t y_ac_qi,
+                                const bool choose_loop_filter )
+{
+  InterFrame frame { width(), height() };
+
+  frame.mutable_header() = analysis.header();
+  frame.mutable_header().quant_indices.y_ac_qi = y_ac_qi;
+  clear_token_prob_updates( frame.mutable_header() );
+
+  /* the segments (and their quantizers) are assigned anew: they match the
+     analysis's unless size trimming gives macroblocks a segment of their own */
+  const auto segment_indices = assign_segments( original_raster, frame );
+
+  MutableRasterHandle reconstructed_raster_handle { width(), height() };
+  VP8Raster & reconstructed_raster = reconstructed_raster_handle.get();
+
+  TokenBranchCounts token_branch_counts;
+  vector<TokenBranchCounts> row_counts( VP8Raster::macroblock_dimension( height() ) );
+
+  forall_macroblocks_wavefront(
+    [&] ( const unsigned int mb_column, const unsigned int mb_row )
+    {
+      const auto original_mb = original_raster.macroblock( mb_column, mb_row );
+      auto reconstructed_mb = reconstructed_raster.macroblock( mb_column, mb_row );
+      auto temp_mb = temp_raster().macroblock( mb_column, mb_row );
+      auto & original_fmb = analysis.macroblocks().at( mb_column, mb_row );
+      auto & frame_mb = frame.mutable_macroblocks().at( mb_column, mb_row );
+
+      const Quantizer quantizer( segment_indices.at( frame_mb.segment_id() ) );
+
+      update_macroblock( original_mb.macroblock(), reconstructed_mb, temp_mb, frame_mb,
+                         original_fmb, quantizer );
+
+      frame_mb.calculate_has_nonzero();
+      frame_mb.accumulate_token_branches( row_counts.at( mb_row ) );
+    }
+  );
+
+  sum_token_branches( row_counts, token_branch_counts );
+
+  frame.relink_y2_blocks();
+
+  optimize_prob_skip( frame );
+  optimize_interframe_probs( frame );
+  optimize_probability_tables( frame, token_branch_counts );
+
+  /* the best filter depends on the quantizer, but not enough to matter for
+     the size */
+  if ( choose_loop_filter ) {
+    apply_best_loopfilter_settings( original_raster, reconstructed_raster, frame );
+  }
+
+  return frame;
+}
+
+vector<uint8_t> Encoder::transcode( const VP8Raster & raster,
+                                   const KeyFrame & original_frame,
+                                   const uint8_t y_ac_qi )
+{
+  /* the probabilities of a keyframe start over */
+  decoder_state_ = DecoderState( width(), height() );
+
+  KeyFrame frame { width(), height() };
+
+  frame.mutable_header() = original_frame.header();
+  frame.mutable_header().quant_indices.y_ac_qi = y_ac_qi;
+  frame.mutable_header().refresh_entropy_probs = true;
+  clear_token_prob_updates( frame.mutable_header() );
+
+  const auto segment_indices = assign_segments( raster, frame );
+
+  MutableRasterHandle reconstructed_raster_handle { width(), height() };
+  VP8Raster & reconstructed_raster = reconstructed_raster_handle.get();
+
+  TokenBranchCounts token_branch_counts;
+  vector<TokenBranchCounts> row_counts( VP8Raster::macroblock_dimension( height() ) );
+
+  forall_macroblocks_wavefront(
+    [&] ( const unsigned int mb_column, const unsigned int mb_row )
+    {
+      const auto original_mb = raster.macroblock( mb_column, mb_row );
+      auto reconstructed_mb = reconstructed_raster.macroblock( mb_column, mb_row );
+      auto temp_mb = temp_raster().macroblock( mb_column, mb_row );
+      auto & original_fmb = original_frame.macroblocks().at( mb_column, mb_row );
+      auto & frame_mb = frame.mutable_macroblocks().at( mb_column, mb_row );
+
+      const Quantizer quantizer( segment_indices.at( frame_mb.segment_id() ) );
+
+      frame_mb.mutable_header() = original_fmb.header();
+      update_intra_macroblock( original_mb.macroblock(), reconstructed_mb, temp_mb, frame_mb,
+                               original_fmb, quantizer );
+
+      frame_mb.accumulate_token_branches( row_counts.at( mb_row ) );
+    }
+  );
+
+  sum_token_branches( row_counts, token_branch_counts );
+
+  frame.relink_y2_blocks();
+
+  optimize_prob_skip( frame );
+  optimize_probability_tables( frame, token_branch_counts );
+
+  apply_best_loopfilter_settings( raster, reconstructed_raster, frame );
+
+  has_state_ = true;
+  return write_frame( frame );
+}
+
+vector<uint8_t> Encoder::transcode( const VP8Raster & raster,
+                                   const InterFrame & original_frame,
+                                   const uint8_t y_ac_qi )
+{
+  if ( not has_state_ ) {
+    throw runtime_error( "an inter frame can't be transcoded before a keyframe" );
+  }
+
+  return write_frame( requantize( raster, original_frame, y_ac_qi, true ) );
+}
+
+void Encoder::reencode( FrameInput & original_rasters,
                         const vector<pair<Optional<KeyFrame>, Optional<InterFrame>>> & prediction_frames,
                         const double kf_q_weight,
                         const bool extra_frame_chunk,
                         IVFWriter & ivf_writer )
 {
-  if ( original_rasters.empty() ) {
-    throw runtime_error( "no rasters to re-encode" );
-  } else if ( original_rasters.size() != prediction_frames.size() ) {
-    throw runtime_error( "prediction/original_rasters mismatch" );
+  if ( prediction_frames.empty() ) {
+    throw runtime_error( "no frames to re-encode" );
   }
 
   unsigned int start_frame_index = ( extra_frame_chunk ? 1 : 0 );
 
-  for ( unsigned int frame_index = start_frame_index;
-        frame_index < original_rasters.size();
+  /* the rasters are read as they're needed, not all ahead, but the frames
+     are only written once all of them turn out to match the predictions;
+     the compressed frames are small next to the rasters */
+  vector<vector<uint8_t>> output_frames;
+  output_frames.reserve( prediction_frames.size() );
+
+  for ( unsigned int frame_index = 0;
+        frame_index < prediction_frames.size();
         frame_index++ ) {
-    const VP8Raster & target_output = original_rasters.at( frame_index ).get();
+    const Optional<RasterHandle> original_raster = original_rasters.get_next_frame();
+
+    if ( not original_raster.initialized() ) {
+      throw runtime_error( "prediction/original_rasters mismatch" );
+    }
+
+    if ( frame_index < start_frame_index ) {
+      continue;
+    }
+
+    const VP8Raster & target_output = original_raster.get().get();
 
     bool last_frame = ( frame_index == prediction_frames.size() - 1 );
 
@@ -347,7 +616,7 @@ void Encoder::reencode( const vector<RasterHandle> & original_rasters,
         }
       }
 
-      ivf_writer.append_frame( write_frame( reencode_as_interframe( target_output, prediction_frame_ref.first.get(), new_quantizer ) ) );
+      output_frames.push_back( write_frame( reencode_as_interframe( target_output, prediction_frame_ref.first.get(), new_quantizer ) ) );
 
       continue;
     } else if ( frame_index == start_frame_index and extra_frame_chunk ) {
@@ -362,15 +631,15 @@ void Encoder::reencode( const vector<RasterHandle> & original_rasters,
       new_quantizer.y_ac_qi = lrint( kf_q_weight *  prediction_frames.at( 0 ).first.get().header().quant_indices.y_ac_qi
                                      + ( 1 - kf_q_weight ) * prediction_frame_ref.second.get().header().quant_indices.y_ac_qi );
 
-      ivf_writer.append_frame( write_frame( update_residues( target_output,
+      output_frames.push_back( write_frame( update_residues( target_output,
                                                              prediction_frame_ref.second.get(),
                                                              new_quantizer, last_frame ) ) );
     } else if ( prediction_frame_ref.first.initialized() ) {
       /* Option 3: Is this another KeyFrame? Then preserve it. */
-      ivf_writer.append_frame( write_frame( prediction_frame_ref.first.get() ) );
+      output_frames.push_back( write_frame( prediction_frame_ref.first.get() ) );
     } else if ( prediction_frame_ref.second.initialized() ) {
       /* Option 4: Is this an InterFrame? Then update residues. */
-      ivf_writer.append_frame( write_frame( update_residues( target_output,
+      output_frames.push_back( write_frame( update_residues( target_output,
                                                              prediction_frame_ref.second.get(),
                                                              prediction_frame_ref.second.get().header().quant_indices,
                                                              last_frame ) ) );
@@ -378,4 +647,12 @@ void Encoder::reencode( const vector<RasterHandle> & original_rasters,
       throw runtime_error( "prediction_frames contained two undefined values" );
     }
   }
+
+  if ( original_rasters.get_next_frame().initialized() ) {
+    throw runtime_error( "prediction/original_rasters mismatch" );
+  }
+
+  for ( const auto & output_frame : output_frames ) {
+    ivf_writer.append_frame( output_frame );
+  }
 }
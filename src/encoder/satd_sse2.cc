@@ -0,0 +1,146 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Sum of absolute transformed differences, using the (unnormalized) 4x4
+   Walsh-Hadamard transform. Two horizontally adjacent 4x4 blocks are
+   transformed at once, one in each half of the registers. */
+
+#include <emmintrin.h>  // SSE2
+#include <stdint.h>
+
+#define HADAMARD4(r0, r1, r2, r3)              \
+  do {                                          \
+    const __m128i a0 = _mm_add_epi16(r0, r1);   \
+    const __m128i a1 = _mm_sub_epi16(r0, r1);   \
+    const __m128i a2 = _mm_add_epi16(r2, r3);   \
+    const __m128i a3 = _mm_sub_epi16(r2, r3);   \
+    r0 = _mm_add_epi16(a0, a2);                 \
+    r1 = _mm_add_epi16(a1, a3);                 \
+    r2 = _mm_sub_epi16(a0, a2);                 \
+    r3 = _mm_sub_epi16(a1, a3);                 \
+  } while (0)
+
+static inline __m128i satd_load_diff8(const uint8_t *src, const uint8_t *ref) {
+  const __m128i zero = _mm_setzero_si128();
+  return _mm_sub_epi16(
+      _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src), zero),
+      _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)ref), zero));
+}
+
+static inline __m128i satd_load_diff4(const uint8_t *src, const uint8_t *ref) {
+  const __m128i zero = _mm_setzero_si128();
+  return _mm_sub_epi16(
+      _mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const uint32_t *)src), zero),
+      _mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const uint32_t *)ref), zero));
+}
+
+/* rows r0..r3 hold the differences of two 4x4 blocks side by side;
+   returns the sum of the absolute transform coefficients, four 32-bit lanes */
+static inline __m128i satd_4x4_pair(__m128i r0, __m128i r1, __m128i r2,
+                                    __m128i r3) {
+  HADAMARD4(r0, r1, r2, r3);
+
+  /* transpose each 4x4 half */
+  const __m128i t0 = _mm_unpacklo_epi16(r0, r1);
+  const __m128i t1 = _mm_unpackhi_epi16(r0, r1);
+  const __m128i t2 = _mm_unpacklo_epi16(r2, r3);
+  const __m128i t3 = _mm_unpackhi_epi16(r2, r3);
+
+  const __m128i u0 = _mm_unpacklo_epi32(t0, t2);
+  const __m128i u1 = _mm_unpackhi_epi32(t0, t2);
+  const __m128i u2 = _mm_unpacklo_epi32(t1, t3);
+  const __m128i u3 = _mm_unpackhi_epi32(t1, t3);
+
+  __m128i c0 = _mm_unpacklo_epi64(u0, u2);
+  __m128i c1 = _mm_unpackhi_epi64(u0, u2);
+  __m128i c2 = _mm_unpacklo_epi64(u1, u3);
+  __m128i c3 = _mm_unpackhi_epi64(u1, u3);
+
+  HADAMARD4(c0, c1, c2, c3);
+
+  /* |x| = max(x, -x); the coefficients fit in 16 bits (|x| <= 16 * 255) */
+  const __m128i zero = _mm_setzero_si128();
+  c0 = _mm_max_epi16(c0, _mm_sub_epi16(zero, c0));
+  c1 = _mm_max_epi16(c1, _mm_sub_epi16(zero, c1));
+  c2 = _mm_max_epi16(c2, _mm_sub_epi16(zero, c2));
+  c3 = _mm_max_epi16(c3, _mm_sub_epi16(zero, c3));
+
+  const __m128i ones = _mm_set1_epi16(1);
+  return _mm_add_epi32(
+      _mm_add_epi32(_mm_madd_epi16(c0, ones), _mm_madd_epi16(c1, ones)),
+      _mm_add_epi32(_mm_madd_epi16(c2, ones), _mm_madd_epi16(c3, ones)));
+}
+
+static inline uint32_t satd_hsum(__m128i vsum) {
+  vsum = _mm_add_epi32(vsum, _mm_srli_si128(vsum, 8));
+  vsum = _mm_add_epi32(vsum, _mm_srli_si128(vsum, 4));
+  return _mm_cvtsi128_si32(vsum);
+}
+
+static inline __m128i satd_8x4(const uint8_t *src, int src_stride,
+                               const uint8_t *ref, int ref_stride) {
+  return satd_4x4_pair(
+      satd_load_diff8(src, ref),
+      satd_load_diff8(src + src_stride, ref + ref_stride),
+      satd_load_diff8(src + 2 * src_stride, ref + 2 * ref_stride),
+      satd_load_diff8(src + 3 * src_stride, ref + 3 * ref_stride));
+}
+
+uint32_t satd4x4_sse2(const uint8_t *src, int src_stride,
+                      const uint8_t *ref, int ref_stride) {
+  return satd_hsum(satd_4x4_pair(
+      satd_load_diff4(src, ref),
+      satd_load_diff4(src + src_stride, ref + ref_stride),
+      satd_load_diff4(src + 2 * src_stride, ref + 2 * ref_stride),
+      satd_load_diff4(src + 3 * src_stride, ref + 3 * ref_stride)));
+}
+
+uint32_t satd8x8_sse2(const uint8_t *src, int src_stride,
+                      const uint8_t *ref, int ref_stride) {
+  __m128i vsum = satd_8x4(src, src_stride, ref, ref_stride);
+  vsum = _mm_add_epi32(vsum, satd_8x4(src + 4 * src_stride, src_stride,
+                                      ref + 4 * ref_stride, ref_stride));
+  return satd_hsum(vsum);
+}
+
+uint32_t satd16x16_sse2(const uint8_t *src, int src_stride,
+                        const uint8_t *ref, int ref_stride) {
+  __m128i vsum = _mm_setzero_si128();
+
+  for (int i = 0; i < 16; i += 4) {
+    vsum = _mm_add_epi32(vsum, satd_8x4(src, src_stride, ref, ref_stride));
+    vsum = _mm_add_epi32(vsum, satd_8x4(src + 8, src_stride, ref + 8, ref_stride));
+
+    src += 4 * src_stride;
+    ref += 4 * ref_stride;
+  }
+
+  return satd_hsum(vsum);
+}
+
+#undef HADAMARD4
@@ -26,6 +26,8 @@
    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+#include <future>
+
 #include "uncompressed_chunk.hh"
 #include "frame.hh"
 #include "bool_encoder.hh"
@@ -409,13 +411,30 @@ vector< vector< uint8_t > > Frame< FrameHeaderType, MacroblockType >::serialize_
 {
   vector< BoolEncoder > dct_partitions( dct_partition_count() );
 
-  /* serialize every macroblock's tokens */
-  macroblock_headers_.get().forall_ij( [&]( const MacroblockType & macroblock,
-                                            const unsigned int column __attribute((unused)),
-                                            const unsigned int row )
-                                       {
-                                         macroblock.serialize_tokens( dct_partitions.at( row % dct_partition_count() ),
-                                                                      probability_tables ); } );
+  /* macroblock rows are interleaved between the partitions, and every
+     partition has its own bool encoder, so they're serialized concurrently */
+  auto serialize_partition = [&]( const unsigned int partition )
+    {
+      const auto & macroblocks = macroblock_headers_.get();
+
+      for ( unsigned int row = partition; row < macroblocks.height(); row += dct_partition_count() ) {
+        for ( unsigned int column = 0; column < macroblocks.width(); column++ ) {
+          macroblocks.at( column, row ).serialize_tokens( dct_partitions.at( partition ),
+                                                          probability_tables );
+        }
+      }
+    };
+
+  vector< future< void > > pending;
+  for ( unsigned int partition = 1; partition < dct_partition_count(); partition++ ) {
+    pending.emplace_back( async( launch::async, serialize_partition, partition ) );
+  }
+
+  serialize_partition( 0 );
+
+  for ( auto & result : pending ) {
+    result.get();
+  }
 
   /* finish encoding and return the resulting octet sequences */
   vector< vector< uint8_t > > ret;
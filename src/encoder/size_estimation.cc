@@ -26,7 +26,10 @@
    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+#include <algorithm>
+#include <cmath>
 #include <utility>
+#include <vector>
 
 #include "encoder.hh"
 
@@ -179,3 +182,75 @@ size_t Encoder::estimate_frame_size( const VP8Raster & raster, const size_t y_ac
     return estimate_size<InterFrame>( raster, y_ac_qi );
   }
 }
+
+FirstPassStats Encoder::first_pass( const RasterHandle & raster, const uint8_t y_ac_qi )
+{
+  if ( width() != raster.get().display_width() or height() != raster.get().display_height() ) {
+    throw runtime_error( "scaling is not supported" );
+  }
+
+  FirstPassStats stats;
+  stats.intra_size = estimate_size<KeyFrame>( raster, y_ac_qi );
+
+  if ( not has_state_ ) {
+    stats.inter_size = stats.intra_size;
+  }
+  else {
+    stats.inter_size = estimate_size<InterFrame>( raster, y_ac_qi );
+
+    /* the median, since a few blocks of a repetitive texture can match
+       far away */
+    vector<double> lengths;
+
+    const InterFrame & frame = subsampled_inter_frame_;
+    frame.macroblocks().forall(
+      [&] ( const InterFrameMacroblock & frame_mb )
+      {
+        if ( frame_mb.inter_coded() ) {
+          const MotionVector & mv = frame_mb.base_motion_vector();
+          lengths.push_back( hypot( mv.x(), mv.y() ) / 4.0 ); /* quarter pixels */
+        }
+      }
+    );
+
+    if ( not lengths.empty() ) {
+      nth_element( lengths.begin(), lengths.begin() + lengths.size() / 2, lengths.end() );
+      stats.motion = lengths[ lengths.size() / 2 ];
+    }
+  }
+
+  /* the source stands in for the reconstruction the next frame would
+     be predicted from */
+  references_.last = references_.golden = references_.alternative = raster;
+
+  safe_references_.last = move( SafeReferences::load( references_.last ) );
+  safe_references_.golden = move( SafeReferences::load( references_.golden ) );
+  safe_references_.alternative = move( SafeReferences::load( references_.alternative ) );
+
+  has_state_ = true;
+
+  return stats;
+}
+
+bool Encoder::scene_cut( const VP8Raster & raster )
+{
+  if ( not detect_scene_cuts_ or not has_state_
+       or frames_since_key_frame_ + 1 < MIN_KEY_FRAME_INTERVAL ) {
+    return false;
+  }
+
+  FirstPassStats stats;
+  stats.intra_size = estimate_size<KeyFrame>( raster, ANALYSIS_Y_AC_QI );
+  stats.inter_size = estimate_size<InterFrame>( raster, ANALYSIS_Y_AC_QI );
+
+  return stats.scene_cut();
+}
+
+bool Encoder::decide_key_frame( const VP8Raster & raster )
+{
+  if ( scene_cut( raster ) ) {
+    force_key_frame();
+  }
+
+  return not has_state_;
+}
@@ -0,0 +1,116 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include "encoder.hh"
+
+using namespace std;
+
+#ifndef HAVE_SSE2
+
+template<class BlockType, unsigned int size>
+static void subtract_dct_quantize( const SafeArray<VP8Raster::Block4, size * size> & original_sub,
+                                   const SafeArray<VP8Raster::Block4, size * size> & prediction_sub,
+                                   TwoDSubRange<BlockType, size, size> & blocks,
+                                   const Optional<pair<uint16_t, uint16_t>> & factors,
+                                   SafeArray<int16_t, 16> * walsh_input )
+{
+  blocks.forall_ij(
+    [&] ( BlockType & block, const unsigned int column, const unsigned int row )
+    {
+      DCTCoefficients & coefficients = block.mutable_coefficients();
+
+      coefficients.subtract_dct( original_sub.at( row * size + column ),
+                                 prediction_sub.at( row * size + column ).contents() );
+
+      if ( walsh_input ) {
+        walsh_input->at( row * size + column ) = coefficients.at( 0 );
+        coefficients.set_dc_coefficient( 0 );
+      }
+
+      if ( factors.initialized() ) {
+        coefficients = coefficients.quantize( factors.get() );
+      }
+    }
+  );
+}
+
+#else // SSE2 is supported
+
+#include "transform_quantize_sse2.cc"
+
+template<class BlockType, unsigned int size>
+static void subtract_dct_quantize( const VP8Raster::Block<size * 4> & original,
+                                   const VP8Raster::Block<size * 4> & prediction,
+                                   TwoDSubRange<BlockType, size, size> & blocks,
+                                   const Optional<pair<uint16_t, uint16_t>> & factors,
+                                   SafeArray<int16_t, 16> * walsh_input )
+{
+  const uint16_t dc_factor = factors.initialized() ? factors.get().first : 0;
+  const uint16_t ac_factor = factors.initialized() ? factors.get().second : 0;
+
+  for ( unsigned int row = 0; row < size; row++ ) {
+    for ( unsigned int column = 0; column < size; column += 2 ) {
+      subtract_dct_quantize_4x4x2_sse2( &original.at( 4 * column, 4 * row ), original.stride(),
+                                        &prediction.at( 4 * column, 4 * row ), prediction.stride(),
+                                        dc_factor, ac_factor,
+                                        walsh_input ? &walsh_input->at( row * size + column ) : nullptr,
+                                        &blocks.at( column, row ).mutable_coefficients().at( 0 ),
+                                        &blocks.at( column + 1, row ).mutable_coefficients().at( 0 ) );
+    }
+  }
+}
+
+#endif
+
+void Encoder::luma_mb_subtract_dct_quantize( const VP8Raster::Macroblock & original_mb,
+                                             const VP8Raster::Macroblock & prediction_mb,
+                                             TwoDSubRange<YBlock, 4, 4> & blocks,
+                                             const Optional<pair<uint16_t, uint16_t>> & factors,
+                                             SafeArray<int16_t, 16> * walsh_input )
+{
+#ifndef HAVE_SSE2
+  subtract_dct_quantize( original_mb.Y_sub, prediction_mb.Y_sub, blocks, factors, walsh_input );
+#else
+  subtract_dct_quantize( original_mb.Y, prediction_mb.Y, blocks, factors, walsh_input );
+#endif
+}
+
+void Encoder::chroma_mb_subtract_dct_quantize( const VP8Raster::Macroblock & original_mb,
+                                               const VP8Raster::Macroblock & prediction_mb,
+                                               TwoDSubRange<UVBlock, 2, 2> & u_blocks,
+                                               TwoDSubRange<UVBlock, 2, 2> & v_blocks,
+                                               const Optional<pair<uint16_t, uint16_t>> & factors )
+{
+#ifndef HAVE_SSE2
+  subtract_dct_quantize( original_mb.U_sub, prediction_mb.U_sub, u_blocks, factors, nullptr );
+  subtract_dct_quantize( original_mb.V_sub, prediction_mb.V_sub, v_blocks, factors, nullptr );
+#else
+  subtract_dct_quantize( original_mb.U, prediction_mb.U, u_blocks, factors, nullptr );
+  subtract_dct_quantize( original_mb.V, prediction_mb.V, v_blocks, factors, nullptr );
+#endif
+}
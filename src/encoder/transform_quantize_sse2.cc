@@ -0,0 +1,153 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Residual computation, forward DCT and quantization of two horizontally
+   adjacent 4x4 blocks at once, one in each half of the registers. The
+   arithmetic is exactly that of DCTCoefficients::subtract_dct and
+   DCTCoefficients::quantize. */
+
+#include <emmintrin.h>  // SSE2
+#include <stdint.h>
+
+/* transposes the two 4x4 matrices held in the halves of r0..r3 */
+static inline void transpose_4x4x2( __m128i & r0, __m128i & r1, __m128i & r2, __m128i & r3 )
+{
+  const __m128i t0 = _mm_unpacklo_epi16( r0, r1 );
+  const __m128i t1 = _mm_unpackhi_epi16( r0, r1 );
+  const __m128i t2 = _mm_unpacklo_epi16( r2, r3 );
+  const __m128i t3 = _mm_unpackhi_epi16( r2, r3 );
+
+  const __m128i u0 = _mm_unpacklo_epi32( t0, t2 );
+  const __m128i u1 = _mm_unpackhi_epi32( t0, t2 );
+  const __m128i u2 = _mm_unpacklo_epi32( t1, t3 );
+  const __m128i u3 = _mm_unpackhi_epi32( t1, t3 );
+
+  r0 = _mm_unpacklo_epi64( u0, u2 );
+  r1 = _mm_unpackhi_epi64( u0, u2 );
+  r2 = _mm_unpacklo_epi64( u1, u3 );
+  r3 = _mm_unpackhi_epi64( u1, u3 );
+}
+
+/* ( c * k.first + d * k.second + round ) >> shift, on the interleaved
+   (c, d) pairs of cd_lo and cd_hi */
+template<int shift>
+static inline __m128i fdct_rotate( const __m128i cd_lo, const __m128i cd_hi,
+                                   const __m128i k, const __m128i round )
+{
+  const __m128i lo = _mm_srai_epi32( _mm_add_epi32( _mm_madd_epi16( cd_lo, k ), round ), shift );
+  const __m128i hi = _mm_srai_epi32( _mm_add_epi32( _mm_madd_epi16( cd_hi, k ), round ), shift );
+  return _mm_packs_epi32( lo, hi );
+}
+
+/* truncating division; exact, since |x| < 2^15 leaves the quotient at
+   least 2^-15 (relative) away from the next integer */
+static inline __m128i quantize_sse2( const __m128i x, const __m128 q_lo, const __m128 q_hi )
+{
+  const __m128i lo = _mm_srai_epi32( _mm_unpacklo_epi16( x, x ), 16 );
+  const __m128i hi = _mm_srai_epi32( _mm_unpackhi_epi16( x, x ), 16 );
+  return _mm_packs_epi32( _mm_cvttps_epi32( _mm_div_ps( _mm_cvtepi32_ps( lo ), q_lo ) ),
+                          _mm_cvttps_epi32( _mm_div_ps( _mm_cvtepi32_ps( hi ), q_hi ) ) );
+}
+
+/* out0 and out1 receive the coefficients of the left and right block in
+   raster order. If dc isn't null, the unquantized DCs are stored there and
+   zeroed in the output. A zero ac_factor skips quantization. */
+void subtract_dct_quantize_4x4x2_sse2( const uint8_t * src, const int src_stride,
+                                       const uint8_t * pred, const int pred_stride,
+                                       const uint16_t dc_factor, const uint16_t ac_factor,
+                                       int16_t * dc, int16_t * out0, int16_t * out1 )
+{
+  const __m128i zero = _mm_setzero_si128();
+
+  __m128i r[ 4 ];
+  for ( int i = 0; i < 4; i++ ) {
+    const __m128i s = _mm_loadl_epi64( reinterpret_cast<const __m128i *>( src + i * src_stride ) );
+    const __m128i p = _mm_loadl_epi64( reinterpret_cast<const __m128i *>( pred + i * pred_stride ) );
+    r[ i ] = _mm_sub_epi16( _mm_unpacklo_epi8( s, zero ), _mm_unpacklo_epi8( p, zero ) );
+  }
+
+  /* first pass, along the rows: r[ j ] holds column j */
+  transpose_4x4x2( r[ 0 ], r[ 1 ], r[ 2 ], r[ 3 ] );
+
+  const __m128i a1 = _mm_slli_epi16( _mm_add_epi16( r[ 0 ], r[ 3 ] ), 3 );
+  const __m128i b1 = _mm_slli_epi16( _mm_add_epi16( r[ 1 ], r[ 2 ] ), 3 );
+  const __m128i c1 = _mm_slli_epi16( _mm_sub_epi16( r[ 1 ], r[ 2 ] ), 3 );
+  const __m128i d1 = _mm_slli_epi16( _mm_sub_epi16( r[ 0 ], r[ 3 ] ), 3 );
+
+  const __m128i k_cd = _mm_set_epi16( 5352, 2217, 5352, 2217, 5352, 2217, 5352, 2217 );
+  const __m128i k_dc = _mm_set_epi16( 2217, -5352, 2217, -5352, 2217, -5352, 2217, -5352 );
+
+  __m128i t[ 4 ];
+  t[ 0 ] = _mm_add_epi16( a1, b1 );
+  t[ 2 ] = _mm_sub_epi16( a1, b1 );
+  t[ 1 ] = fdct_rotate<12>( _mm_unpacklo_epi16( c1, d1 ), _mm_unpackhi_epi16( c1, d1 ),
+                            k_cd, _mm_set1_epi32( 14500 ) );
+  t[ 3 ] = fdct_rotate<12>( _mm_unpacklo_epi16( c1, d1 ), _mm_unpackhi_epi16( c1, d1 ),
+                            k_dc, _mm_set1_epi32( 7500 ) );
+
+  /* second pass, along the columns: t[ i ] holds row i */
+  transpose_4x4x2( t[ 0 ], t[ 1 ], t[ 2 ], t[ 3 ] );
+
+  const __m128i a2 = _mm_add_epi16( t[ 0 ], t[ 3 ] );
+  const __m128i b2 = _mm_add_epi16( t[ 1 ], t[ 2 ] );
+  const __m128i c2 = _mm_sub_epi16( t[ 1 ], t[ 2 ] );
+  const __m128i d2 = _mm_sub_epi16( t[ 0 ], t[ 3 ] );
+
+  const __m128i seven = _mm_set1_epi16( 7 );
+  const __m128i d2_nonzero = _mm_andnot_si128( _mm_cmpeq_epi16( d2, zero ), _mm_set1_epi16( 1 ) );
+
+  __m128i o[ 4 ];
+  o[ 0 ] = _mm_srai_epi16( _mm_add_epi16( _mm_add_epi16( a2, b2 ), seven ), 4 );
+  o[ 2 ] = _mm_srai_epi16( _mm_add_epi16( _mm_sub_epi16( a2, b2 ), seven ), 4 );
+  o[ 1 ] = _mm_add_epi16( fdct_rotate<16>( _mm_unpacklo_epi16( c2, d2 ), _mm_unpackhi_epi16( c2, d2 ),
+                                           k_cd, _mm_set1_epi32( 12000 ) ),
+                          d2_nonzero );
+  o[ 3 ] = fdct_rotate<16>( _mm_unpacklo_epi16( c2, d2 ), _mm_unpackhi_epi16( c2, d2 ),
+                            k_dc, _mm_set1_epi32( 51000 ) );
+
+  if ( dc ) {
+    dc[ 0 ] = static_cast<int16_t>( _mm_extract_epi16( o[ 0 ], 0 ) );
+    dc[ 1 ] = static_cast<int16_t>( _mm_extract_epi16( o[ 0 ], 4 ) );
+    o[ 0 ] = _mm_and_si128( o[ 0 ], _mm_set_epi16( -1, -1, -1, 0, -1, -1, -1, 0 ) );
+  }
+
+  if ( ac_factor ) {
+    const __m128 ac = _mm_set1_ps( ac_factor );
+    const __m128 dc_ac = _mm_set_ps( ac_factor, ac_factor, ac_factor, dc_factor );
+
+    o[ 0 ] = quantize_sse2( o[ 0 ], dc_ac, dc_ac );
+    for ( int i = 1; i < 4; i++ ) {
+      o[ i ] = quantize_sse2( o[ i ], ac, ac );
+    }
+  }
+
+  _mm_storeu_si128( reinterpret_cast<__m128i *>( out0 ),     _mm_unpacklo_epi64( o[ 0 ], o[ 1 ] ) );
+  _mm_storeu_si128( reinterpret_cast<__m128i *>( out0 + 8 ), _mm_unpacklo_epi64( o[ 2 ], o[ 3 ] ) );
+  _mm_storeu_si128( reinterpret_cast<__m128i *>( out1 ),     _mm_unpackhi_epi64( o[ 0 ], o[ 1 ] ) );
+  _mm_storeu_si128( reinterpret_cast<__m128i *>( out1 + 8 ), _mm_unpackhi_epi64( o[ 2 ], o[ 3 ] ) );
+}
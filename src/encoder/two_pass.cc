@@ -0,0 +1,138 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "two_pass.hh"
+
+using namespace std;
+
+/* a frame that the previous one predicts this poorly starts a new scene */
+static constexpr double SCENE_CUT_RATIO = 0.85;
+
+/* frames that move less than this (in pixels) keep looking like their
+   keyframe */
+static constexpr double STATIC_MOTION = 1.0;
+
+bool FirstPassStats::scene_cut() const
+{
+  return inter_size >= SCENE_CUT_RATIO * intra_size;
+}
+
+string FirstPassStats::str() const
+{
+  ostringstream out;
+  out << intra_size << " " << inter_size << " " << motion;
+  return out.str();
+}
+
+FirstPassStats FirstPassStats::parse( const string & line )
+{
+  FirstPassStats stats;
+  istringstream in { line };
+
+  if ( not ( in >> stats.intra_size >> stats.inter_size >> stats.motion ) ) {
+    throw runtime_error( "invalid first-pass statistics: " + line );
+  }
+
+  return stats;
+}
+
+vector<FirstPassStats> FirstPassStats::read( const string & filename )
+{
+  ifstream in { filename };
+
+  if ( not in.is_open() ) {
+    throw runtime_error( "could not open " + filename );
+  }
+
+  vector<FirstPassStats> stats;
+  string line;
+
+  while ( getline( in, line ) ) {
+    if ( not line.empty() ) {
+      stats.push_back( parse( line ) );
+    }
+  }
+
+  return stats;
+}
+
+TwoPassPlan::TwoPassPlan( const vector<FirstPassStats> & stats,
+                          const size_t min_key_frame_interval )
+  : key_frames_( stats.size(), false ), weights_( stats.size(), 0.0 )
+{
+  size_t last_key_frame = 0;
+
+  for ( size_t i = 0; i < stats.size(); i++ ) {
+    if ( i == 0 or ( i - last_key_frame >= min_key_frame_interval and stats[ i ].scene_cut() ) ) {
+      key_frames_[ i ] = true;
+      last_key_frame = i;
+    }
+
+    /* the sizes at a fixed quantizer are what the frames take at a steady
+       quality, so a budget split in proportion to them keeps it steady */
+    weights_[ i ] = max<size_t>( 1, key_frames_[ i ] ? stats[ i ].intra_size
+                                                     : stats[ i ].inter_size );
+  }
+
+  /* the frames of a mostly static scene keep predicting from its keyframe,
+     so it's worth making that one better */
+  for ( size_t i = 0; i < stats.size(); ) {
+    size_t next = i + 1;
+    size_t static_frames = 0;
+
+    for ( ; next < stats.size() and not key_frames_[ next ]; next++ ) {
+      static_frames += stats[ next ].motion < STATIC_MOTION;
+    }
+
+    if ( next > i + 1 ) {
+      weights_[ i ] *= 1.0 + static_cast<double>( static_frames ) / ( next - i - 1 );
+    }
+
+    i = next;
+  }
+}
+
+void TwoPassPlan::allocate( const size_t total_size )
+{
+  double total_weight = 0;
+
+  for ( const double weight : weights_ ) {
+    total_weight += weight;
+  }
+
+  frame_sizes_.resize( weights_.size() );
+
+  for ( size_t i = 0; i < weights_.size(); i++ ) {
+    frame_sizes_[ i ] = total_size * weights_[ i ] / total_weight;
+  }
+}
@@ -0,0 +1,85 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef TWO_PASS_HH
+#define TWO_PASS_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* the quantizer that frame sizes are estimated at for analysis */
+static constexpr uint8_t ANALYSIS_Y_AC_QI = 64;
+
+/* scene cuts closer than this to the last keyframe don't get one */
+static constexpr size_t MIN_KEY_FRAME_INTERVAL = 8;
+
+/* what the first pass learns about a frame: its estimated size at a fixed
+   quantizer when intra-coded and when predicted from the previous frame,
+   and the median length of the motion vectors (in pixels) of the latter */
+struct FirstPassStats
+{
+  size_t intra_size { 0 };
+  size_t inter_size { 0 };
+  double motion { 0.0 };
+
+  /* the previous frame predicts this one hardly better than intra coding
+     does, so it starts a new scene */
+  bool scene_cut() const;
+
+  /* one line of a stats file */
+  std::string str() const;
+  static FirstPassStats parse( const std::string & line );
+
+  static std::vector<FirstPassStats> read( const std::string & filename );
+};
+
+/* the second pass's plan: keyframes where the previous frame predicts a
+   frame hardly better than intra coding does (scene cuts), and a budget of
+   bytes split across the frames by their complexity */
+class TwoPassPlan
+{
+private:
+  std::vector<bool> key_frames_ {};
+  std::vector<double> weights_ {};
+  std::vector<size_t> frame_sizes_ {};
+
+public:
+  TwoPassPlan( const std::vector<FirstPassStats> & stats,
+               const size_t min_key_frame_interval );
+
+  /* splits total_size bytes across the frames */
+  void allocate( const size_t total_size );
+
+  size_t frame_count() const { return key_frames_.size(); }
+  bool key_frame( const size_t frame_no ) const { return key_frames_.at( frame_no ); }
+  size_t frame_size( const size_t frame_no ) const { return frame_sizes_.at( frame_no ); }
+};
+
+#endif /* TWO_PASS_HH */
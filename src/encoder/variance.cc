@@ -81,9 +81,54 @@ uint32_t Encoder::variance( const VP8Raster::Block<size> & block,
   return res - ( ( int64_t)sum * sum ) / ( size * size );
 }
 
+template<unsigned int size>
+uint32_t Encoder::satd( const VP8Raster::Block<size> & block,
+                        const TwoDSubRange<uint8_t, size, size> & prediction )
+{
+  uint32_t res = 0;
+
+  for ( size_t sb_row = 0; sb_row < size; sb_row += 4 ) {
+    for ( size_t sb_column = 0; sb_column < size; sb_column += 4 ) {
+      int32_t diff[ 4 ][ 4 ];
+
+      for ( size_t i = 0; i < 4; i++ ) {
+        for ( size_t j = 0; j < 4; j++ ) {
+          diff[ j ][ i ] = block.at( sb_column + i, sb_row + j )
+                           - prediction.at( sb_column + i, sb_row + j );
+        }
+      }
+
+      /* rows, then columns */
+      for ( size_t j = 0; j < 4; j++ ) {
+        const int32_t a0 = diff[ j ][ 0 ] + diff[ j ][ 1 ];
+        const int32_t a1 = diff[ j ][ 0 ] - diff[ j ][ 1 ];
+        const int32_t a2 = diff[ j ][ 2 ] + diff[ j ][ 3 ];
+        const int32_t a3 = diff[ j ][ 2 ] - diff[ j ][ 3 ];
+
+        diff[ j ][ 0 ] = a0 + a2;
+        diff[ j ][ 1 ] = a1 + a3;
+        diff[ j ][ 2 ] = a0 - a2;
+        diff[ j ][ 3 ] = a1 - a3;
+      }
+
+      for ( size_t i = 0; i < 4; i++ ) {
+        const int32_t a0 = diff[ 0 ][ i ] + diff[ 1 ][ i ];
+        const int32_t a1 = diff[ 0 ][ i ] - diff[ 1 ][ i ];
+        const int32_t a2 = diff[ 2 ][ i ] + diff[ 3 ][ i ];
+        const int32_t a3 = diff[ 2 ][ i ] - diff[ 3 ][ i ];
+
+        res += abs( a0 + a2 ) + abs( a1 + a3 ) + abs( a0 - a2 ) + abs( a1 - a3 );
+      }
+    }
+  }
+
+  return res;
+}
+
 #else // SSE2 is supported
 
 #include "variance_sse2.cc"
+#include "satd_sse2.cc"
 
 /* SAD() */
 template<>
@@ -163,4 +208,30 @@ uint32_t Encoder::variance( const VP8Raster::Block<16> & block,
                                  &sse );
 }
 
+/* SATD() */
+
+template<>
+uint32_t Encoder::satd( const VP8Raster::Block<4> & block,
+                        const TwoDSubRange<uint8_t, 4, 4> & prediction )
+{
+  return satd4x4_sse2( &block.contents().at( 0, 0 ), block.contents().stride(),
+                       &prediction.at( 0, 0 ), prediction.stride() );
+}
+
+template<>
+uint32_t Encoder::satd( const VP8Raster::Block<8> & block,
+                        const TwoDSubRange<uint8_t, 8, 8> & prediction )
+{
+  return satd8x8_sse2( &block.contents().at( 0, 0 ), block.contents().stride(),
+                       &prediction.at( 0, 0 ), prediction.stride() );
+}
+
+template<>
+uint32_t Encoder::satd( const VP8Raster::Block<16> & block,
+                        const TwoDSubRange<uint8_t, 16, 16> & prediction )
+{
+  return satd16x16_sse2( &block.contents().at( 0, 0 ), block.contents().stride(),
+                         &prediction.at( 0, 0 ), prediction.stride() );
+}
+
 #endif
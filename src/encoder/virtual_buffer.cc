@@ -0,0 +1,83 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "virtual_buffer.hh"
+
+using namespace std;
+
+/* the gap to the target fullness is closed over this many frames */
+static constexpr double CORRECTION_FRAMES = 8.0;
+
+/* keyframes are worth more, since the frames after them predict from them */
+static constexpr double KEY_FRAME_BOOST = 4.0;
+
+/* with less room than this fraction of a frame interval's bytes, even the
+   coarsest quantizer is unlikely to fit, so it's also the smallest target */
+static constexpr double MINIMUM_ROOM = 0.25;
+
+VirtualBuffer::VirtualBuffer( const double bitrate, const double frame_rate,
+                              const double size, const double initial_fullness )
+  : bytes_per_frame_( bitrate / 8 / frame_rate ), size_( size ),
+    target_fullness_( initial_fullness ), fullness_( initial_fullness )
+{
+  if ( bitrate <= 0 or frame_rate <= 0 ) {
+    throw runtime_error( "the bitrate and the frame rate must be positive" );
+  }
+
+  if ( size < bytes_per_frame_ ) {
+    throw runtime_error( "the buffer must hold at least one frame interval" );
+  }
+
+  if ( initial_fullness < 0 or initial_fullness > size ) {
+    throw runtime_error( "the initial buffer fullness must be within its size" );
+  }
+}
+
+bool VirtualBuffer::has_room() const
+{
+  return size_ - fullness_ >= MINIMUM_ROOM * bytes_per_frame_;
+}
+
+size_t VirtualBuffer::target_size( const bool key_frame ) const
+{
+  double target = bytes_per_frame_ + ( target_fullness_ - fullness_ ) / CORRECTION_FRAMES;
+
+  if ( key_frame ) {
+    target *= KEY_FRAME_BOOST;
+  }
+
+  return max( MINIMUM_ROOM * bytes_per_frame_, min( size_ - fullness_, target ) );
+}
+
+void VirtualBuffer::update( const size_t frame_size )
+{
+  fullness_ = max( 0.0, fullness_ + frame_size - bytes_per_frame_ );
+}
@@ -0,0 +1,67 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef VIRTUAL_BUFFER_HH
+#define VIRTUAL_BUFFER_HH
+
+#include <cstddef>
+
+/* the buffer that holds the encoded frames until a constant-bitrate channel
+   has sent them: each frame adds its size, and the channel takes out a
+   frame interval's worth of bytes. the frame size targets steer the buffer
+   back to its initial fullness, and a frame that would overflow it has to
+   be dropped. a frame that can't be dropped (or overshoots its target) can
+   still take the buffer past its size; the excess is kept, so the frames
+   after it are dropped until it drains. (sizes are in bytes.) */
+class VirtualBuffer
+{
+private:
+  double bytes_per_frame_;
+  double size_;
+  double target_fullness_;
+  double fullness_;
+
+public:
+  VirtualBuffer( const double bitrate, const double frame_rate,
+                 const double size, const double initial_fullness );
+
+  /* whether there's room for the next frame (if not, it should be dropped) */
+  bool has_room() const;
+
+  /* the size the next frame should have (never less than a small fraction
+     of a frame interval's bytes, even without room) */
+  size_t target_size( const bool key_frame ) const;
+
+  /* a frame (or the stand-in for a dropped one) was sent */
+  void update( const size_t frame_size );
+
+  double fullness() const { return fullness_; }
+  bool overflowed() const { return fullness_ > size_; }
+};
+
+#endif /* VIRTUAL_BUFFER_HH */
@@ -0,0 +1,349 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "yuv4mpeg.hh"
+#include "uncompressed_chunk.hh"
+#include "frame.hh"
+#include "decoder.hh"
+#include "encoder.hh"
+#include "ivf_writer.hh"
+#include "paranoid.hh"
+
+using namespace std;
+
+void usage_error( const string & program_name )
+{
+  cerr << "Usage: " << program_name << " [options] <input.y4m> <output.ivf>"                 << endl
+                                                                                             << endl
+       << "Encodes the chunks of the input in parallel, each from a keyframe, then"          << endl
+       << "rebases them one after the other onto the state the previous one ends in."        << endl
+                                                                                             << endl
+       << "Options:"                                                                         << endl
+       << " -n <arg>, --chunk-size=<arg>          Frames per chunk (default: 16)"            << endl
+       << " -s <arg>, --ssim=<arg>                SSIM for the chunks (default: 0.99)"       << endl
+       << " -y <arg>, --y-ac-qi=<arg>             Quantization index for Y of the chunks"    << endl
+       << " -q, --quality=(best|rt)               Quality setting"                           << endl
+       << "                                         best: best quality, slowest (default)"   << endl
+       << "                                         rt:   real-time"                         << endl
+       << " -j <arg>, --jobs=<arg>                Chunks encoded at once"                    << endl
+       << "                                         (default: all cores)"                    << endl
+       << " -w <arg>, --kf-q-weight=<arg>         Keyframe quantizer weight of the rebase"   << endl
+       << "                                         (default: 1.0)"                          << endl
+       << endl;
+}
+
+using Clock = chrono::steady_clock;
+
+static double seconds_since( const Clock::time_point & start )
+{
+  return chrono::duration<double>( Clock::now() - start ).count();
+}
+
+/* the frames of one chunk, for Encoder::reencode */
+class ChunkFrames : public FrameInput
+{
+private:
+  vector<RasterHandle> rasters_;
+  size_t next_ { 0 };
+
+public:
+  ChunkFrames( vector<RasterHandle> && rasters ) : rasters_( move( rasters ) ) {}
+
+  Optional<RasterHandle> get_next_frame() override
+  {
+    if ( next_ == rasters_.size() ) {
+      return {};
+    }
+
+    return Optional<RasterHandle>( move( rasters_.at( next_++ ) ) );
+  }
+
+  uint16_t display_width() override { return rasters_.front().get().display_width(); }
+  uint16_t display_height() override { return rasters_.front().get().display_height(); }
+};
+
+struct EncodedChunk
+{
+  vector<vector<uint8_t>> frames {};
+  Decoder final_state;
+  double seconds { 0.0 };
+  Clock::time_point finished {};
+};
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc <= 0 ) {
+      abort();
+    }
+
+    size_t chunk_size = 16;
+    double ssim = 0.99;
+    Optional<uint8_t> y_ac_qi;
+    EncoderQuality quality = BEST_QUALITY;
+    unsigned int jobs = 0;
+    double kf_q_weight = 1.0;
+
+    const option command_line_options[] = {
+      { "chunk-size",           required_argument, nullptr, 'n' },
+      { "ssim",                 required_argument, nullptr, 's' },
+      { "y-ac-qi",              required_argument, nullptr, 'y' },
+      { "quality",              required_argument, nullptr, 'q' },
+      { "jobs",                 required_argument, nullptr, 'j' },
+      { "kf-q-weight",          required_argument, nullptr, 'w' },
+      { 0, 0, 0, 0 }
+    };
+
+    while ( true ) {
+      const int opt = getopt_long( argc, argv, "n:s:y:q:j:w:", command_line_options, nullptr );
+
+      if ( opt == -1 ) {
+        break;
+      }
+
+      switch ( opt ) {
+      case 'n':
+        chunk_size = paranoid::parse_bounded( optarg, "chunk size", 1, 65535 );
+        break;
+
+      case 's':
+        ssim = stod( optarg );
+        y_ac_qi.clear();
+        break;
+
+      case 'y':
+        y_ac_qi.reset( paranoid::parse_bounded( optarg, "quantization index", 0, 127 ) );
+        break;
+
+      case 'q':
+        if ( strcmp( optarg, "rt" ) == 0 ) {
+          quality = REALTIME_QUALITY;
+        }
+
+        break;
+
+      case 'j':
+        jobs = paranoid::parse_bounded( optarg, "jobs", 0, 1024 );
+        break;
+
+      case 'w':
+        kf_q_weight = stod( optarg );
+        break;
+
+      default:
+        usage_error( argv[ 0 ] );
+        return EXIT_FAILURE;
+      }
+    }
+
+    if ( optind + 2 != argc ) {
+      usage_error( argv[ 0 ] );
+      return EXIT_FAILURE;
+    }
+
+    if ( jobs == 0 ) {
+      jobs = max( 1u, thread::hardware_concurrency() );
+    }
+
+    const auto start = Clock::now();
+
+    YUV4MPEGReader input { argv[ optind ] };
+    const uint16_t width = input.display_width();
+    const uint16_t height = input.display_height();
+
+    /* the input is read a chunk at a time, as the encoders need it */
+    double read_seconds = 0.0;
+    bool input_done = false;
+
+    auto read_chunk =
+      [&] ()
+      {
+        const auto read_start = Clock::now();
+        vector<RasterHandle> chunk;
+
+        while ( not input_done and chunk.size() < chunk_size ) {
+          Optional<RasterHandle> raster = input.get_next_frame();
+
+          if ( not raster.initialized() ) {
+            input_done = true;
+            break;
+          }
+
+          chunk.push_back( raster.get() );
+        }
+
+        read_seconds += seconds_since( read_start );
+        return chunk;
+      };
+
+    auto encode_chunk =
+      [&] ( const vector<RasterHandle> & chunk )
+      {
+        const auto chunk_start = Clock::now();
+
+        /* the chunks are what runs in parallel, so the encoder searches
+           its quantizers one at a time (the default) */
+        Encoder encoder { width, height, false, quality };
+
+        vector<vector<uint8_t>> frames;
+
+        for ( const RasterHandle & raster : chunk ) {
+          frames.push_back( y_ac_qi.initialized()
+                            ? encoder.encode_with_quantizer( raster.get(), y_ac_qi.get() )
+                            : encoder.encode_with_minimum_ssim( raster.get(), ssim ) );
+        }
+
+        return EncodedChunk { move( frames ), encoder.export_decoder(),
+                              seconds_since( chunk_start ), Clock::now() };
+      };
+
+    /* the chunks being encoded, each from a keyframe, in input order: `jobs`
+       of them, and one more while the oldest is rebased. the futures wait
+       for their encodes when they go away, even on an error. */
+    const auto encode_start = Clock::now();
+
+    deque<pair<vector<RasterHandle>, future<EncodedChunk>>> pending;
+
+    auto fill_pending =
+      [&] ()
+      {
+        while ( not input_done and pending.size() <= jobs ) {
+          vector<RasterHandle> chunk = read_chunk();
+
+          if ( chunk.empty() ) {
+            break;
+          }
+
+          future<EncodedChunk> encoded = async( launch::async, encode_chunk, chunk );
+          pending.emplace_back( move( chunk ), move( encoded ) );
+        }
+      };
+
+    fill_pending();
+
+    if ( pending.empty() ) {
+      throw runtime_error( "no frames in the input" );
+    }
+
+    /* rebase each chunk onto the state that the previous one (as rebased)
+       ends in, and write it out */
+    IVFWriter output { argv[ optind + 1 ], "VP80", width, height, 1, 1 };
+
+    size_t chunk_count = 0;
+    double encode_seconds = 0.0;
+    double rebase_seconds = 0.0;
+    Clock::time_point encode_end = encode_start;
+    Optional<Decoder> state;
+
+    for ( ; not pending.empty(); chunk_count++ ) {
+      EncodedChunk encoded = pending.front().second.get();
+      vector<RasterHandle> chunk = move( pending.front().first );
+      pending.pop_front();
+      fill_pending();
+
+      encode_seconds += encoded.seconds;
+      encode_end = max( encode_end, encoded.finished );
+
+      cerr << "Chunk #" << chunk_count << ": encoded (" << encoded.seconds << " s)";
+
+      if ( not state.initialized() ) {
+        for ( const auto & frame : encoded.frames ) {
+          output.append_frame( frame );
+        }
+
+        state.initialize( move( encoded.final_state ) );
+        cerr << "." << endl;
+        continue;
+      }
+
+      const auto rebase_start = Clock::now();
+
+      /* the modes and motion vectors to keep, as the chunk's own decoder
+         sees them */
+      vector<pair<Optional<KeyFrame>, Optional<InterFrame>>> prediction_frames;
+      Decoder prediction_decoder { width, height };
+
+      for ( const auto & frame : encoded.frames ) {
+        UncompressedChunk uch { Chunk( frame ), width, height, false };
+
+        if ( uch.key_frame() ) {
+          KeyFrame key_frame = prediction_decoder.parse_frame<KeyFrame>( uch );
+          prediction_decoder.decode_frame( key_frame );
+
+          prediction_frames.emplace_back( move( key_frame ), Optional<InterFrame>() );
+        }
+        else {
+          InterFrame inter_frame = prediction_decoder.parse_frame<InterFrame>( uch );
+          prediction_decoder.decode_frame( inter_frame );
+
+          prediction_frames.emplace_back( Optional<KeyFrame>(), move( inter_frame ) );
+        }
+      }
+
+      Encoder encoder { state.get(), false, quality };
+      encoder.set_wavefront_threads( 0 );
+
+      ChunkFrames rasters { move( chunk ) };
+      encoder.reencode( rasters, prediction_frames, kf_q_weight, false, output );
+
+      state.reset( encoder.export_decoder() );
+
+      const double seconds = seconds_since( rebase_start );
+      rebase_seconds += seconds;
+      cerr << ", rebased (" << seconds << " s)." << endl;
+    }
+
+    /* the rebase overlaps the encoding, except for the chunks that are left
+       once the last one is encoded */
+    cerr << "Done: " << chunk_count << " chunks in " << seconds_since( start ) << " s." << endl
+         << "  read:          " << read_seconds << " s" << endl
+         << "  encode:        " << chrono::duration<double>( encode_end - encode_start ).count()
+         << " s (" << encode_seconds << " s in all, " << jobs << " jobs)" << endl
+         << "  serial rebase: " << rebase_seconds << " s (" << seconds_since( encode_end )
+         << " s after the last encode)" << endl;
+  }
+  catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
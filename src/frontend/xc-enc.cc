@@ -34,9 +34,11 @@
 #include <iostream>
 #include <string>
 #include <chrono>
+#include <deque>
 
 #include "frame_input.hh"
 #include "ivf_reader.hh"
+#include "queued_input.hh"
 #include "yuv4mpeg.hh"
 #include "frame.hh"
 #include "player.hh"
@@ -47,6 +49,9 @@
 #include "ivf_writer.hh"
 #include "display.hh"
 #include "enc_state_serializer.hh"
+#include "two_pass.hh"
+#include "virtual_buffer.hh"
+#include "paranoid.hh"
 
 using namespace std;
 
@@ -70,7 +75,55 @@ void usage_error( const string & program_name )
        << " -F <arg>, --frame-sizes=<arg>         Target frame sizes file"                   << endl
        << "                                         Each line specifies the target size"     << endl
        << "                                         in bytes for the corresponding frame."   << endl
+       << " --trim-sizes                          Make frames with a target size a"          << endl
+       << "                                         step finer except for their most"        << endl
+       << "                                         expensive macroblocks, to fill it"       << endl
+       << " -B <arg>, --bpred-candidates=<arg>    Subblock modes to evaluate per"            << endl
+       << "                                         subblock, 2-10 (default: 10)"            << endl
+       << " -D <arg>, --distortion=(pixel|satd)   Distortion for ranking predictions"        << endl
+       << "                                         pixel: SSE/variance (default)"           << endl
+       << "                                         satd:  Hadamard transformed"             << endl
+       << " -M <arg>, --inter-search=<arg>        Inter prediction search effort"            << endl
+       << "                                         last:     LAST_FRAME only (default)"     << endl
+       << "                                         refs:     all reference frames"          << endl
+       << "                                         split:    refs + SPLITMV, 8x8 and up"    << endl
+       << "                                         split4x4: refs + all SPLITMV partitions" << endl
+       << " -R <arg>, --intra-refresh=<arg>       Intra-refresh period in frames"            << endl
+       << "                                         (default: 0, off)"                       << endl
+       << " -j <arg>, --threads=<arg>             Quantizers tried at once by the"           << endl
+       << "                                         SSIM search (default: all cores)"        << endl
+       << " -P <arg>, --partitions=<arg>          DCT token partitions, 1/2/4/8"             << endl
+       << "                                         (default: 1)"                            << endl
        << " --two-pass                            Do the second encoding pass"               << endl
+       << " -T <arg>, --trellis-levels=<arg>      Levels tried per coefficient by"           << endl
+       << "                                         trellis quantization, 1-4 (default: 2)"  << endl
+       << " --trellis-final                       Trellis-quantize only the chosen"          << endl
+       << "                                         modes (default: all candidates)"         << endl
+       << " -a <arg>, --first-pass=<arg>          Only write first-pass statistics"          << endl
+       << "                                         to the given file"                       << endl
+       << " -A <arg>, --stats=<arg>               Place keyframes at the scene cuts"         << endl
+       << "                                         in first-pass statistics"                << endl
+       << " -t <arg>, --target-size=<arg>         Total size in bytes, split across"         << endl
+       << "                                         frames by the statistics"                << endl
+       << " -Q <arg>, --aq-strength=<arg>         Quantizer index offset of flat and"        << endl
+       << "                                         busy macroblocks (default: 0, off)"      << endl
+       << " -m <arg>, --roi-map=<arg>             Region of interest map: one number"        << endl
+       << "                                         per macroblock, nonzero inside"          << endl
+       << " -d <arg>, --roi-qi-delta=<arg>        Quantizer index offset of the region"      << endl
+       << "                                         of interest (default: 16)"               << endl
+       << " --scene-cuts                          Make a keyframe at each scene cut"         << endl
+       << " -L <arg>, --lookahead=<arg>           Spread the target sizes of this many"      << endl
+       << "                                         upcoming frames by their complexity"     << endl
+       << " -b <arg>, --bitrate=<arg>             Constant bitrate in kbit/s; frames"        << endl
+       << "                                         that overflow the buffer are dropped"    << endl
+       << " -u <arg>, --buffer-size=<arg>         Rate buffer size in ms (default: 1000)"    << endl
+       << " -U <arg>, --buffer-initial=<arg>      Initial rate buffer fullness in ms"        << endl
+       << "                                         (default: 500)"                          << endl
+       << " -k <arg>, --frame-rate=<arg>          Frame rate for the bitrate (default: 30)"  << endl
+       << " -l <arg>, --temporal-layers=<arg>     Temporal layers, 1-3 (default: 1); the"    << endl
+       << "                                         upper ones can be dropped"               << endl
+       << " -H <arg>, --hashes=<arg>              Write the decoder minihash after each"     << endl
+       << "                                         frame to this file, in hex"              << endl
                                                                                              << endl
        << "Re-encode:"                                                                       << endl
        << " -r, --reencode                        Re-encode"                                 << endl
@@ -79,9 +132,14 @@ void usage_error( const string & program_name )
        << " -w, --kf-q-weight <arg>               Keyframe quantizer weight"                 << endl
        << " -e, --extra-frame-chunk               Prediction IVF starts with an extra frame" << endl
        << " -W, --no-no_wait                      Don't wait for STDIN to start reencoding"  << endl
+       << " -J, --reencode-threads <arg>          Macroblock rows re-encoded at once"        << endl
+       << "                                         (default: all cores)"                    << endl
        << endl;
 }
 
+/* how many input frames are read ahead of the encoder */
+static constexpr size_t INPUT_QUEUE_FRAMES = 4;
+
 size_t read_next_frame_size( istream & in )
 {
   static size_t last_size = numeric_limits<size_t>::max();
@@ -93,6 +151,52 @@ size_t read_next_frame_size( istream & in )
   return last_size;
 }
 
+vector<uint8_t> read_roi_map( const string & filename )
+{
+  ifstream in { filename };
+
+  if ( not in.is_open() ) {
+    throw runtime_error( "could not open " + filename );
+  }
+
+  vector<uint8_t> roi_map;
+  unsigned int value;
+
+  while ( in >> value ) {
+    roi_map.push_back( value != 0 );
+  }
+
+  return roi_map;
+}
+
+/* a frame that was read ahead of the encoder */
+struct PendingFrame
+{
+  RasterHandle raster;
+  size_t target_size;
+  FirstPassStats stats;
+};
+
+/* the target sizes of the pending frames, spread in proportion to their
+   estimated sizes; returns the share of the first one */
+size_t spread_target_size( const deque<PendingFrame> & frames )
+{
+  auto complexity = []( const FirstPassStats & stats ) -> double
+    {
+      return max<size_t>( 1, stats.scene_cut() ? stats.intra_size : stats.inter_size );
+    };
+
+  double total_size = 0;
+  double total_complexity = 0;
+
+  for ( const PendingFrame & frame : frames ) {
+    total_size += frame.target_size;
+    total_complexity += complexity( frame.stats );
+  }
+
+  return total_size * complexity( frames.front().stats ) / total_complexity;
+}
+
 int main( int argc, char *argv[] )
 {
   try {
@@ -120,6 +224,30 @@ int main( int argc, char *argv[] )
     bool no_wait = false;
     Optional<uint8_t> y_ac_qi;
     EncoderQuality quality = BEST_QUALITY;
+    uint8_t bpred_candidates = num_intra_b_modes;
+    DistortionMetric distortion_metric = PIXEL_DISTORTION;
+    InterSearchEffort inter_search_effort = LAST_FRAME_SEARCH;
+    uint16_t intra_refresh_period = 0;
+    unsigned int search_threads = 0;
+    unsigned int reencode_threads = 0;
+    uint8_t dct_partitions = 1;
+    uint8_t trellis_levels = 2;
+    TrellisScope trellis_scope = TRELLIS_ALL_CANDIDATES;
+    string first_pass_file = "";
+    string stats_file = "";
+    size_t total_size = 0;
+    uint8_t aq_strength = 0;
+    string roi_map_file = "";
+    uint8_t roi_qi_delta = 16;
+    bool detect_scene_cuts = false;
+    bool size_trimming = false;
+    size_t lookahead = 0;
+    double bitrate = 0;
+    double buffer_size_ms = 1000;
+    double buffer_initial_ms = 500;
+    double frame_rate = 30;
+    uint8_t temporal_layers = 1;
+    string hashes_file = "";
 
     EncoderMode encoder_mode = MINIMUM_SSIM;
 
@@ -139,12 +267,36 @@ int main( int argc, char *argv[] )
       { "extra-frame-chunk",    no_argument,       nullptr, 'e' },
       { "quality",              required_argument, nullptr, 'q' },
       { "frame-sizes",          required_argument, nullptr, 'F' },
+      { "trim-sizes",           no_argument,       nullptr, 'g' },
       { "no-wait",              no_argument,       nullptr, 'W' },
+      { "bpred-candidates",     required_argument, nullptr, 'B' },
+      { "distortion",           required_argument, nullptr, 'D' },
+      { "inter-search",         required_argument, nullptr, 'M' },
+      { "intra-refresh",        required_argument, nullptr, 'R' },
+      { "threads",              required_argument, nullptr, 'j' },
+      { "reencode-threads",     required_argument, nullptr, 'J' },
+      { "partitions",           required_argument, nullptr, 'P' },
+      { "trellis-levels",       required_argument, nullptr, 'T' },
+      { "trellis-final",        no_argument,       nullptr, 'f' },
+      { "first-pass",           required_argument, nullptr, 'a' },
+      { "stats",                required_argument, nullptr, 'A' },
+      { "target-size",          required_argument, nullptr, 't' },
+      { "aq-strength",          required_argument, nullptr, 'Q' },
+      { "roi-map",              required_argument, nullptr, 'm' },
+      { "roi-qi-delta",         required_argument, nullptr, 'd' },
+      { "scene-cuts",           no_argument,       nullptr, 'c' },
+      { "lookahead",            required_argument, nullptr, 'L' },
+      { "bitrate",              required_argument, nullptr, 'b' },
+      { "buffer-size",          required_argument, nullptr, 'u' },
+      { "buffer-initial",       required_argument, nullptr, 'U' },
+      { "frame-rate",           required_argument, nullptr, 'k' },
+      { "temporal-layers",      required_argument, nullptr, 'l' },
+      { "hashes",               required_argument, nullptr, 'H' },
       { 0, 0, 0, 0 }
     };
 
     while ( true ) {
-      const int opt = getopt_long( argc, argv, "o:s:i:O:I:2y:p:S:rw:eq:F:W", command_line_options, nullptr );
+      const int opt = getopt_long( argc, argv, "o:s:i:O:I:2y:p:S:rw:eq:F:WB:D:M:R:j:J:P:T:fa:A:t:Q:m:d:cL:b:u:U:k:l:gH:", command_line_options, nullptr );
 
       if ( opt == -1 ) {
         break;
@@ -218,6 +370,136 @@ int main( int argc, char *argv[] )
         encoder_mode = TARGET_FRAME_SIZE;
         break;
 
+      case 'B':
+        bpred_candidates = paranoid::parse_bounded( optarg, "B_PRED candidates",
+                                                    1, num_intra_b_modes );
+        break;
+
+      case 'D':
+        if ( strcmp( optarg, "satd" ) == 0 ) {
+          distortion_metric = SATD_DISTORTION;
+        }
+        else if ( strcmp( optarg, "pixel" ) != 0 ) {
+          throw runtime_error( "unknown distortion metric" );
+        }
+
+        break;
+
+      case 'M':
+        if ( strcmp( optarg, "last" ) == 0 ) {
+          inter_search_effort = LAST_FRAME_SEARCH;
+        }
+        else if ( strcmp( optarg, "refs" ) == 0 ) {
+          inter_search_effort = ALL_REFERENCES_SEARCH;
+        }
+        else if ( strcmp( optarg, "split" ) == 0 ) {
+          inter_search_effort = SPLITMV_SEARCH;
+        }
+        else if ( strcmp( optarg, "split4x4" ) == 0 ) {
+          inter_search_effort = FULL_SPLITMV_SEARCH;
+        }
+        else {
+          throw runtime_error( "unknown inter search effort" );
+        }
+
+        break;
+
+      case 'R':
+        intra_refresh_period = paranoid::parse_bounded( optarg, "intra-refresh period",
+                                                        0, 65535 );
+        break;
+
+      case 'j':
+        search_threads = stoul( optarg );
+        break;
+
+      case 'J':
+        reencode_threads = stoul( optarg );
+        break;
+
+      case 'P':
+      {
+        /* parsed wide, so that out-of-range counts don't wrap around */
+        const unsigned long partitions = stoul( optarg );
+
+        if ( partitions != 1 and partitions != 2 and partitions != 4 and partitions != 8 ) {
+          throw runtime_error( "DCT token partitions must be 1, 2, 4 or 8" );
+        }
+
+        dct_partitions = partitions;
+        break;
+      }
+
+      case 'T':
+        trellis_levels = paranoid::parse_bounded( optarg, "trellis levels", 1, 4 );
+        break;
+
+      case 'f':
+        trellis_scope = TRELLIS_FINAL_MODE;
+        break;
+
+      case 'a':
+        first_pass_file = optarg;
+        break;
+
+      case 'A':
+        stats_file = optarg;
+        break;
+
+      case 't':
+        total_size = stoul( optarg );
+        encoder_mode = TARGET_FRAME_SIZE;
+        break;
+
+      case 'Q':
+        aq_strength = paranoid::parse_bounded( optarg, "AQ strength", 0, 127 );
+        break;
+
+      case 'm':
+        roi_map_file = optarg;
+        break;
+
+      case 'd':
+        roi_qi_delta = paranoid::parse_bounded( optarg, "ROI quantizer offset", 0, 127 );
+        break;
+
+      case 'c':
+        detect_scene_cuts = true;
+        break;
+
+      case 'g':
+        size_trimming = true;
+        break;
+
+      case 'L':
+        lookahead = stoul( optarg );
+        break;
+
+      case 'b':
+        bitrate = stod( optarg ) * 1000;
+        encoder_mode = CONSTANT_BITRATE;
+        break;
+
+      case 'u':
+        buffer_size_ms = stod( optarg );
+        break;
+
+      case 'U':
+        buffer_initial_ms = stod( optarg );
+        break;
+
+      case 'k':
+        frame_rate = stod( optarg );
+        break;
+
+      case 'l':
+        temporal_layers = paranoid::parse_bounded( optarg, "temporal layers", 1, 3 );
+        break;
+
+      case 'H':
+        hashes_file = optarg;
+        break;
+
       default:
         throw runtime_error( "getopt_long: unexpected return value." );
       }
@@ -251,6 +533,32 @@ int main( int argc, char *argv[] )
       throw runtime_error( "unsupported input format" );
     }
 
+    /* the input is read on a thread of its own, a few frames ahead */
+    input_reader = make_shared<QueuedFrameInput>( input_reader, INPUT_QUEUE_FRAMES );
+
+    if ( not first_pass_file.empty() ) {
+      /* first pass: nothing is encoded */
+      Encoder encoder( input_reader->display_width(), input_reader->display_height(),
+                       false, quality );
+
+      encoder.set_distortion_metric( distortion_metric );
+      encoder.set_inter_search_effort( inter_search_effort );
+
+      ofstream stats_out { first_pass_file };
+      const uint8_t first_pass_y_ac_qi = y_ac_qi.initialized() ? y_ac_qi.get() : ANALYSIS_Y_AC_QI;
+
+      for ( auto raster = input_reader->get_next_frame(); raster.initialized();
+            raster = input_reader->get_next_frame() ) {
+        stats_out << encoder.first_pass( raster.get(), first_pass_y_ac_qi ).str() << endl;
+      }
+
+      return EXIT_SUCCESS;
+    }
+
+    if ( total_size > 0 and stats_file.empty() ) {
+      throw runtime_error( "--target-size needs first-pass statistics (--stats)" );
+    }
+
     Decoder pred_decoder( input_reader->display_width(), input_reader->display_height() );
 
     if ( pred_file != "" and pred_ivf_initial_state != "") {
@@ -265,16 +573,8 @@ int main( int argc, char *argv[] )
         throw runtime_error( "re-encoding without an input_state" );
       }
 
-      /* pre-read all the original rasters */
-      vector<RasterHandle> original_rasters;
-      for ( size_t i = 0; ; i++ ) {
-        auto next_raster = input_reader->get_next_frame();
-
-        if ( next_raster.initialized() ) {
-          original_rasters.emplace_back( next_raster.get() );
-        } else {
-          break;
-        }
+      if ( not hashes_file.empty() ) {
+        throw runtime_error( "unsupported: re-encoding with --hashes" );
       }
 
       /* pre-read all the prediction frames */
@@ -313,9 +613,27 @@ int main( int argc, char *argv[] )
       Encoder encoder( EncoderStateDeserializer::build<Decoder>( input_state ),
                        two_pass, quality );
 
+      encoder.set_bpred_candidates( bpred_candidates );
+      encoder.set_distortion_metric( distortion_metric );
+      encoder.set_inter_search_effort( inter_search_effort );
+      encoder.set_intra_refresh_period( intra_refresh_period );
+      encoder.set_quantizer_search_threads( search_threads );
+      encoder.set_dct_partitions( dct_partitions );
+      encoder.set_trellis_levels( trellis_levels );
+      encoder.set_trellis_scope( trellis_scope );
+      encoder.set_wavefront_threads( reencode_threads );
+
+      /* the macroblocks are segmented as in the prediction, if that was
+         encoded with the same options */
+      encoder.set_aq_strength( aq_strength );
+
+      if ( not roi_map_file.empty() ) {
+        encoder.set_roi_map( read_roi_map( roi_map_file ), roi_qi_delta );
+      }
+
       output.set_expected_decoder_entry_hash( encoder.export_decoder().get_hash().hash() );
 
-      encoder.reencode( original_rasters, prediction_frames, kf_q_weight,
+      encoder.reencode( *input_reader, prediction_frames, kf_q_weight,
                         extra_frame_chunk, output );
 
       if (output_state != "") {
@@ -332,13 +650,40 @@ int main( int argc, char *argv[] )
         : Encoder( EncoderStateDeserializer::build<Decoder>( input_state ),
                    two_pass, quality );
 
+      encoder.set_bpred_candidates( bpred_candidates );
+      encoder.set_distortion_metric( distortion_metric );
+      encoder.set_inter_search_effort( inter_search_effort );
+      encoder.set_intra_refresh_period( intra_refresh_period );
+      encoder.set_quantizer_search_threads( search_threads );
+      encoder.set_dct_partitions( dct_partitions );
+      encoder.set_trellis_levels( trellis_levels );
+      encoder.set_trellis_scope( trellis_scope );
+      encoder.set_aq_strength( aq_strength );
+      encoder.set_size_trimming( size_trimming );
+      encoder.set_scene_cut_detection( detect_scene_cuts );
+      encoder.set_temporal_layers( temporal_layers );
+
+      if ( not roi_map_file.empty() ) {
+        encoder.set_roi_map( read_roi_map( roi_map_file ), roi_qi_delta );
+      }
+
       if ( not input_state.empty() ) {
         output.set_expected_decoder_entry_hash( encoder.export_decoder().get_hash().hash() );
       }
 
+      Optional<TwoPassPlan> plan;
+
+      if ( not stats_file.empty() ) {
+        plan.initialize( FirstPassStats::read( stats_file ), MIN_KEY_FRAME_INTERVAL );
+
+        if ( total_size > 0 ) {
+          plan.get().allocate( total_size );
+        }
+      }
+
       ifstream frame_sizes_if;
 
-      if ( encoder_mode == TARGET_FRAME_SIZE ) {
+      if ( encoder_mode == TARGET_FRAME_SIZE and total_size == 0 ) {
         if ( frame_sizes_file != "-" ) {
           frame_sizes_if.open( frame_sizes_file.c_str() );
         }
@@ -348,38 +693,149 @@ int main( int argc, char *argv[] )
                               ? frame_sizes_if
                               : cin;
 
-      unsigned int frame_no = 0;
-      for ( auto raster = input_reader->get_next_frame(); raster.initialized();
-            raster = input_reader->get_next_frame() ) {
+      /* with a lookahead, frames are read (and analyzed) ahead of the
+         encoder, which spreads their target sizes by complexity */
+      Optional<Encoder> analysis_encoder;
 
-        cerr << "Encoding frame #" << frame_no++ << "...";
-        const auto encode_beginning = chrono::system_clock::now();
+      if ( lookahead > 0 ) {
+        if ( encoder_mode != TARGET_FRAME_SIZE or total_size > 0 ) {
+          throw runtime_error( "--lookahead needs target frame sizes (--frame-sizes)" );
+        }
 
-        switch ( encoder_mode ) {
-        case MINIMUM_SSIM:
-          output.append_frame( encoder.encode_with_minimum_ssim( raster.get(), ssim ) );
-          break;
+        analysis_encoder.initialize( input_reader->display_width(), input_reader->display_height(),
+                                     false, quality );
+      }
 
-        case CONSTANT_QUANTIZER:
-          cerr << " [estimated size=" << encoder.estimate_frame_size( raster.get(), y_ac_qi.get() ) << "] ";
-          output.append_frame( encoder.encode_with_quantizer( raster.get(), y_ac_qi.get() ) );
-          break;
+      Optional<VirtualBuffer> rate_buffer;
 
-        case TARGET_FRAME_SIZE:
-        {
-          size_t target_size = read_next_frame_size( frame_sizes );
-          output.append_frame( encoder.encode_with_target_size( raster.get(), target_size ) );
-          cerr << " [target_size=" << target_size << "] ";
-          break;
+      if ( encoder_mode == CONSTANT_BITRATE ) {
+        rate_buffer.initialize( bitrate, frame_rate,
+                                bitrate / 8 * buffer_size_ms / 1000,
+                                bitrate / 8 * buffer_initial_ms / 1000 );
+      }
+
+      /* what a decoder of the output should be in after each frame */
+      ofstream hashes;
+
+      if ( not hashes_file.empty() ) {
+        hashes.open( hashes_file );
+
+        if ( not hashes.is_open() ) {
+          throw runtime_error( "could not open " + hashes_file );
         }
+      }
+
+      deque<PendingFrame> pending_frames;
+      unsigned int frame_no = 0;
 
-        default:
-          throw Unsupported( "unsupported encoder mode." );
+      auto encode_next_frame =
+        [&]()
+        {
+          const PendingFrame & frame = pending_frames.front();
+
+          cerr << "Encoding frame #" << frame_no << "...";
+          const auto encode_beginning = chrono::system_clock::now();
+
+          if ( plan.initialized() ) {
+            if ( frame_no >= plan.get().frame_count() ) {
+              throw runtime_error( "first-pass statistics end before the input" );
+            }
+
+            /* the first frame is a keyframe anyway, unless it continues a state */
+            if ( frame_no > 0 and plan.get().key_frame( frame_no ) ) {
+              encoder.force_key_frame();
+              cerr << " [keyframe] ";
+            }
+          }
+
+          if ( temporal_layers > 1 ) {
+            cerr << " [layer=" << static_cast<int>( encoder.temporal_layer() ) << "] ";
+          }
+
+          switch ( encoder_mode ) {
+          case MINIMUM_SSIM:
+            output.append_frame( encoder.encode_with_minimum_ssim( frame.raster, ssim ) );
+            break;
+
+          case CONSTANT_QUANTIZER:
+            cerr << " [estimated size=" << encoder.estimate_frame_size( frame.raster, y_ac_qi.get() ) << "] ";
+            output.append_frame( encoder.encode_with_quantizer( frame.raster, y_ac_qi.get() ) );
+            break;
+
+          case TARGET_FRAME_SIZE:
+          {
+            size_t target_size = total_size > 0 ? plan.get().frame_size( frame_no )
+                               : lookahead > 0 ? spread_target_size( pending_frames )
+                               : frame.target_size;
+            output.append_frame( encoder.encode_with_target_size( frame.raster, target_size ) );
+            cerr << " [target_size=" << target_size << "] ";
+            break;
+          }
+
+          case CONSTANT_BITRATE:
+          {
+            /* keyframes (planned, scene cuts or the first frame) get the
+               boost, and can't be dropped since there's nothing to repeat */
+            const bool key_frame = encoder.decide_key_frame( frame.raster );
+            const bool dropped = not key_frame and not rate_buffer.get().has_room();
+            const size_t target_size = rate_buffer.get().target_size( key_frame );
+
+            vector<uint8_t> compressed_frame =
+              dropped ? encoder.encode_repeat_frame()
+                      : encoder.encode_with_target_size( frame.raster, target_size );
+
+            rate_buffer.get().update( compressed_frame.size() );
+            output.append_frame( compressed_frame );
+
+            if ( dropped ) {
+              cerr << " [dropped] ";
+            }
+            else {
+              cerr << " [target_size=" << target_size << "] ";
+            }
+
+            cerr << " [buffer=" << static_cast<size_t>( rate_buffer.get().fullness() ) << "] ";
+
+            if ( rate_buffer.get().overflowed() ) {
+              cerr << " [overflow] ";
+            }
+
+            break;
+          }
+
+          default:
+            throw Unsupported( "unsupported encoder mode." );
+          }
+
+          if ( hashes.is_open() ) {
+            hashes << hex << encoder.minihash() << endl;
+          }
+
+          const auto encode_ending = chrono::system_clock::now();
+          const int ms_elapsed = chrono::duration_cast<chrono::milliseconds>( encode_ending - encode_beginning ).count();
+          cerr << "done (" << ms_elapsed << " ms)." << endl;
+
+          pending_frames.pop_front();
+          frame_no++;
+        };
+
+      for ( auto raster = input_reader->get_next_frame(); raster.initialized();
+            raster = input_reader->get_next_frame() ) {
+        const size_t target_size = ( encoder_mode == TARGET_FRAME_SIZE and total_size == 0 )
+                                   ? read_next_frame_size( frame_sizes ) : 0;
+
+        pending_frames.push_back( { raster.get(), target_size,
+                                    analysis_encoder.initialized()
+                                    ? analysis_encoder.get().first_pass( raster.get(), ANALYSIS_Y_AC_QI )
+                                    : FirstPassStats() } );
+
+        if ( pending_frames.size() > lookahead ) {
+          encode_next_frame();
         }
+      }
 
-        const auto encode_ending = chrono::system_clock::now();
-        const int ms_elapsed = chrono::duration_cast<chrono::milliseconds>( encode_ending - encode_beginning ).count();
-        cerr << "done (" << ms_elapsed << " ms)." << endl;
+      while ( not pending_frames.empty() ) {
+        encode_next_frame();
       }
 
       if ( not output_state.empty() ) {
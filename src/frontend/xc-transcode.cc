@@ -0,0 +1,192 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "ivf.hh"
+#include "uncompressed_chunk.hh"
+#include "frame.hh"
+#include "decoder.hh"
+#include "encoder.hh"
+#include "ivf_writer.hh"
+#include "paranoid.hh"
+
+using namespace std;
+
+void usage_error( const string & program_name )
+{
+  cerr << "Usage: " << program_name << " [options] <ivf-in> <ivf-out>"                          << endl
+                                                                                             << endl
+       << "Re-quantizes each frame, keeping its modes and motion vectors."                   << endl
+                                                                                             << endl
+       << "Options:"                                                                         << endl
+       << " -y <arg>, --y-ac-qi=<arg>             Quantization index for Y of every frame"   << endl
+       << " -d <arg>, --qi-delta=<arg>            Offset to the quantization index of each"  << endl
+       << "                                         frame (default: 0)"                      << endl
+       << " -q, --quality=(best|rt)               Quality setting"                           << endl
+       << "                                         best: best quality, slowest (default)"   << endl
+       << "                                         rt:   real-time"                         << endl
+       << " -j <arg>, --threads=<arg>             Macroblock rows requantized at once"       << endl
+       << "                                         (default: all cores)"                    << endl
+       << " -H <arg>, --hashes=<arg>              Write the decoder minihash after each"     << endl
+       << "                                         frame to this file, in hex"              << endl
+       << endl;
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc <= 0 ) {
+      abort();
+    }
+
+    Optional<uint8_t> y_ac_qi;
+    int qi_delta = 0;
+    EncoderQuality quality = BEST_QUALITY;
+    unsigned int threads = 0;
+    string hashes_file = "";
+
+    const option command_line_options[] = {
+      { "y-ac-qi",              required_argument, nullptr, 'y' },
+      { "qi-delta",             required_argument, nullptr, 'd' },
+      { "quality",              required_argument, nullptr, 'q' },
+      { "threads",              required_argument, nullptr, 'j' },
+      { "hashes",               required_argument, nullptr, 'H' },
+      { 0, 0, 0, 0 }
+    };
+
+    while ( true ) {
+      const int opt = getopt_long( argc, argv, "y:d:q:j:H:", command_line_options, nullptr );
+
+      if ( opt == -1 ) {
+        break;
+      }
+
+      switch ( opt ) {
+      case 'y':
+        y_ac_qi.reset( paranoid::parse_bounded( optarg, "quantization index", 0, 127 ) );
+        break;
+
+      case 'd':
+        qi_delta = stoi( optarg );
+        break;
+
+      case 'q':
+        if ( strcmp( optarg, "rt" ) == 0 ) {
+          quality = REALTIME_QUALITY;
+        }
+
+        break;
+
+      case 'j':
+        threads = paranoid::parse_bounded( optarg, "threads", 0, 1024 );
+        break;
+
+      case 'H':
+        hashes_file = optarg;
+        break;
+
+      default:
+        usage_error( argv[ 0 ] );
+        return EXIT_FAILURE;
+      }
+    }
+
+    if ( optind + 2 != argc ) {
+      usage_error( argv[ 0 ] );
+      return EXIT_FAILURE;
+    }
+
+    IVF ivf( argv[ optind ] );
+    IVFWriter ivf_writer( argv[ optind + 1 ], ivf.fourcc(), ivf.width(), ivf.height(),
+                          ivf.frame_rate(), ivf.time_scale() );
+
+    Decoder decoder( ivf.width(), ivf.height() );
+
+    if ( not decoder.minihash_match( ivf.expected_decoder_minihash() ) ) {
+      throw Invalid( "Decoder state / IVF mismatch" );
+    }
+
+    Encoder encoder( ivf.width(), ivf.height(), false, quality );
+    encoder.set_wavefront_threads( threads );
+
+    /* what a decoder of the output should be in after each frame */
+    ofstream hashes;
+
+    if ( not hashes_file.empty() ) {
+      hashes.open( hashes_file );
+
+      if ( not hashes.is_open() ) {
+        throw runtime_error( "could not open " + hashes_file );
+      }
+    }
+
+    auto new_y_ac_qi = [&] ( const uint8_t original_y_ac_qi ) -> uint8_t
+      {
+        return y_ac_qi.initialized()
+               ? y_ac_qi.get()
+               : max( 0, min( 127, original_y_ac_qi + qi_delta ) );
+      };
+
+    /* the decoded frames are the best there is of the originals, so the
+       requantized residues aim at them */
+    for ( size_t i = 0; i < ivf.frame_count(); i++ ) {
+      UncompressedChunk uch { ivf.frame( i ), ivf.width(), ivf.height(), false };
+
+      if ( uch.key_frame() ) {
+        const KeyFrame frame = decoder.parse_frame<KeyFrame>( uch );
+        const RasterHandle raster = decoder.decode_frame( frame ).second;
+
+        ivf_writer.append_frame( encoder.transcode( raster.get(), frame,
+                                                    new_y_ac_qi( frame.header().quant_indices.y_ac_qi ) ) );
+      }
+      else {
+        const InterFrame frame = decoder.parse_frame<InterFrame>( uch );
+        const RasterHandle raster = decoder.decode_frame( frame ).second;
+
+        ivf_writer.append_frame( encoder.transcode( raster.get(), frame,
+                                                    new_y_ac_qi( frame.header().quant_indices.y_ac_qi ) ) );
+      }
+
+      if ( hashes.is_open() ) {
+        hashes << hex << encoder.minihash() << endl;
+      }
+    }
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,105 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <algorithm>
+
+#include "queued_input.hh"
+
+using namespace std;
+
+QueuedFrameInput::QueuedFrameInput( const shared_ptr<FrameInput> & source,
+                                    const size_t capacity )
+  : source_( source ),
+    display_width_( source->display_width() ),
+    display_height_( source->display_height() ),
+    capacity_( max<size_t>( 1, capacity ) ),
+    reader_( &QueuedFrameInput::read_frames, this )
+{}
+
+QueuedFrameInput::~QueuedFrameInput()
+{
+  {
+    unique_lock<mutex> lock { mutex_ };
+    stopping_ = true;
+  }
+
+  changed_.notify_all();
+  reader_.join();
+}
+
+void QueuedFrameInput::read_frames()
+{
+  try {
+    while ( true ) {
+      Optional<RasterHandle> frame = source_->get_next_frame();
+
+      unique_lock<mutex> lock { mutex_ };
+
+      if ( not frame.initialized() ) {
+        finished_ = true;
+        break;
+      }
+
+      changed_.wait( lock, [&] { return stopping_ or frames_.size() < capacity_; } );
+
+      if ( stopping_ ) {
+        return;
+      }
+
+      frames_.push_back( frame.get() );
+      changed_.notify_all();
+    }
+  }
+  catch ( ... ) {
+    unique_lock<mutex> lock { mutex_ };
+    error_ = current_exception();
+    finished_ = true;
+  }
+
+  changed_.notify_all();
+}
+
+Optional<RasterHandle> QueuedFrameInput::get_next_frame()
+{
+  unique_lock<mutex> lock { mutex_ };
+  changed_.wait( lock, [&] { return finished_ or not frames_.empty(); } );
+
+  if ( frames_.empty() ) {
+    if ( error_ ) {
+      rethrow_exception( error_ );
+    }
+
+    return {};
+  }
+
+  Optional<RasterHandle> frame { move( frames_.front() ) };
+  frames_.pop_front();
+  changed_.notify_all();
+
+  return frame;
+}
@@ -0,0 +1,78 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef QUEUED_INPUT_HH
+#define QUEUED_INPUT_HH
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "frame_input.hh"
+
+/* reads the frames of another FrameInput ahead, on a thread of its own, so
+   that reading and encoding overlap. at most `capacity` frames wait in the
+   queue; the reader blocks when it's full, and the frames go back to the
+   raster pool as the encoder is done with them. */
+class QueuedFrameInput : public FrameInput
+{
+private:
+  std::shared_ptr<FrameInput> source_;
+  const uint16_t display_width_;
+  const uint16_t display_height_;
+  const size_t capacity_;
+
+  std::mutex mutex_ {};
+  std::condition_variable changed_ {};
+  std::deque<RasterHandle> frames_ {};
+  bool finished_ { false };
+  bool stopping_ { false };
+  std::exception_ptr error_ {};
+
+  std::thread reader_;
+
+  void read_frames();
+
+public:
+  QueuedFrameInput( const std::shared_ptr<FrameInput> & source, const size_t capacity );
+  ~QueuedFrameInput();
+
+  /* forbid copying or moving: the reader thread refers to this object */
+  QueuedFrameInput( const QueuedFrameInput & other ) = delete;
+  QueuedFrameInput & operator=( const QueuedFrameInput & other ) = delete;
+
+  Optional<RasterHandle> get_next_frame() override;
+
+  uint16_t display_width() override { return display_width_; }
+  uint16_t display_height() override { return display_height_; }
+};
+
+#endif /* QUEUED_INPUT_HH */
@@ -29,6 +29,7 @@
 #include <getopt.h>
 
 #include <cstdlib>
+#include <algorithm>
 #include <random>
 #include <unordered_map>
 #include <utility>
@@ -207,6 +208,12 @@ int main( int argc, char *argv[] )
   deque<uint32_t> complete_states;
   unordered_map<uint32_t, Decoder> decoders { { current_state, player.current_decoder() } };
 
+  /* the latest complete state that refreshed the golden frame. it's never
+     dropped from complete_states, so the sender can always recover from it
+     with an inter frame instead of a keyframe */
+  Optional<uint32_t> golden_state;
+  size_t golden_hash = player.current_decoder().get_hash().golden_hash();
+
   /* memory usage logs */
   system_clock::time_point next_mem_usage_report = system_clock::now();
 
@@ -281,7 +288,9 @@ int main( int argc, char *argv[] )
 
           for ( ; it != complete_states.end(); it++ ) {
             if ( *it != expected_source_state ) {
-              decoders.erase( *it );
+              if ( not golden_state.initialized() or *it != golden_state.get() ) {
+                decoders.erase( *it );
+              }
             }
             else {
               break;
@@ -290,6 +299,12 @@ int main( int argc, char *argv[] )
 
           assert( it != complete_states.end() );
           complete_states.erase( complete_states.begin(), it );
+
+          if ( golden_state.initialized() and
+               find( complete_states.begin(), complete_states.end(),
+                     golden_state.get() ) == complete_states.end() ) {
+            complete_states.push_front( golden_state.get() );
+          }
         }
 
         // here we apply the frame
@@ -303,6 +318,15 @@ int main( int argc, char *argv[] )
           /* this is a full state. let's save it */
           decoders.insert( make_pair( current_state, player.current_decoder() ) );
           complete_states.push_back( current_state );
+
+          const size_t new_golden_hash = player.current_decoder().get_hash().golden_hash();
+
+          if ( new_golden_hash != golden_hash ) {
+            /* this frame refreshed the golden reference. the previous golden
+               state is now pruned like any other complete state */
+            golden_state.reset( current_state );
+            golden_hash = new_golden_hash;
+          }
         }
 
         fragmented_frames.erase( next_frame_no );
@@ -38,8 +38,10 @@
 #include <future>
 #include <algorithm>
 #include <unordered_map>
+#include <unordered_set>
 #include <iomanip>
 #include <cmath>
+#include <memory>
 
 #include "exception.hh"
 #include "finally.hh"
@@ -100,6 +102,9 @@ struct EncodeJob
   uint8_t y_ac_qi;
   size_t target_size;
 
+  /* a mode decision shared with the other jobs for the same frame */
+  shared_ptr<const Optional<InterFrameHandle>> analysis {};
+
   EncodeJob( const string & name, RasterHandle raster, const Encoder & encoder,
              const EncoderMode mode, const uint8_t y_ac_qi, const size_t target_size )
     : name( name ), raster( raster ), encoder( encoder ),
@@ -137,7 +142,11 @@ EncodeOutput do_encode_job( EncodeJob && encode_job )
 
   switch ( encode_job.mode ) {
   case CONSTANT_QUANTIZER:
-    output = encode_job.encoder.encode_with_quantizer( encode_job.raster.get(),
+    output = encode_job.analysis
+           ? encode_job.encoder.encode_with_analysis( encode_job.raster.get(),
+                                                      *encode_job.analysis,
+                                                      encode_job.y_ac_qi )
+           : encode_job.encoder.encode_with_quantizer( encode_job.raster.get(),
                                                        encode_job.y_ac_qi );
     quantizer_in_use = encode_job.y_ac_qi;
     break;
@@ -173,7 +182,9 @@ void usage( const char *argv0 )
 {
   cerr << "Usage: " << argv0
        << " [-m,--mode MODE] [-d, --device CAMERA] [-p, --pixfmt PIXEL_FORMAT]"
-       << " [-u,--update-rate RATE] [--log-mem-usage] HOST PORT CONNECTION_ID" << endl
+       << " [-u,--update-rate RATE] [-c, --scene-cuts] [-l, --temporal-layers N]"
+       << " [-a, --analyze-once] [--log-mem-usage]"
+       << " HOST PORT CONNECTION_ID" << endl
        << endl
        << "Accepted MODEs are s1, s2 (default), conventional." << endl;
 }
@@ -204,6 +215,9 @@ int main( int argc, char *argv[] )
   size_t update_rate __attribute__((unused)) = 1;
   OperationMode operation_mode = OperationMode::S2;
   bool log_mem_usage = false;
+  bool detect_scene_cuts = false;
+  uint8_t temporal_layers = 1;
+  bool analyze_once = false;
 
   const option command_line_options[] = {
     { "mode",          required_argument, nullptr, 'm' },
@@ -211,11 +225,14 @@ int main( int argc, char *argv[] )
     { "pixfmt",        required_argument, nullptr, 'p' },
     { "update-rate",   required_argument, nullptr, 'u' },
     { "log-mem-usage", no_argument,       nullptr, 'M' },
+    { "scene-cuts",    no_argument,       nullptr, 'c' },
+    { "temporal-layers", required_argument, nullptr, 'l' },
+    { "analyze-once",  no_argument,       nullptr, 'a' },
     { 0, 0, 0, 0 }
   };
 
   while ( true ) {
-    const int opt = getopt_long( argc, argv, "d:p:m:u:", command_line_options, nullptr );
+    const int opt = getopt_long( argc, argv, "d:p:m:u:cl:a", command_line_options, nullptr );
 
     if ( opt == -1 ) { break; }
 
@@ -243,6 +260,20 @@ int main( int argc, char *argv[] )
       log_mem_usage = true;
       break;
 
+    case 'c':
+      detect_scene_cuts = true;
+      break;
+
+    case 'l':
+      /* GOLDEN_FRAME is what the receiver recovers from here, so the third
+         layer, whose middle frames refresh it, isn't available */
+      temporal_layers = paranoid::parse_bounded( optarg, "temporal layers", 1, 2 );
+      break;
+
+    case 'a':
+      analyze_once = true;
+      break;
+
     default:
       usage( argv[ 0 ] );
       return EXIT_FAILURE;
@@ -287,6 +318,17 @@ int main( int argc, char *argv[] )
   Encoder base_encoder { camera.display_width(), camera.display_height(),
                          false /* two-pass */, REALTIME_QUALITY };
 
+  /* keyframes still go through B_PRED; only try the most promising subblock modes */
+  base_encoder.set_bpred_candidates( 4 );
+
+  /* intra-code a stripe of every frame, so that the picture gets refreshed
+     without the size spike of a keyframe */
+  base_encoder.set_intra_refresh_period( 60 );
+
+  /* a scene cut is cheaper as a keyframe than as an inter frame */
+  base_encoder.set_scene_cut_detection( detect_scene_cuts );
+  base_encoder.set_temporal_layers( temporal_layers );
+
   const uint32_t initial_state = base_encoder.minihash();
 
   /* encoded frame index */
@@ -319,6 +361,15 @@ int main( int argc, char *argv[] )
   seconds conservative_for { 5 };
   system_clock::time_point conservative_until = system_clock::now();
 
+  /* every so often, a frame also refreshes the golden reference. once the
+     receiver has such a frame as a complete state, it keeps it around, and we
+     can recover from it with an inter frame instead of a keyframe */
+  seconds golden_refresh_interval { 2 };
+  system_clock::time_point next_golden_refresh = system_clock::now() + golden_refresh_interval;
+  bool refreshing_golden = false;
+  unordered_set<uint32_t> golden_states;
+  Optional<uint32_t> receiver_golden_state;
+
   /* for 'conventional codec' mode */
   duration<long int, std::nano> cc_update_interval { ( update_rate == 0 ) ? 0 : std::nano::den / update_rate };
   system_clock::time_point next_cc_update = system_clock::now() + cc_update_interval;
@@ -364,8 +415,10 @@ int main( int argc, char *argv[] )
         while ( it != encoder_states.end() ) {
           if ( *it != receiver_last_acked_state.get() and
                *it != receiver_assumed_state.get() ) {
-            if ( find( next( it ), encoder_states.end(), *it ) == encoder_states.end() ) {
+            if ( find( next( it ), encoder_states.end(), *it ) == encoder_states.end() and
+                 ( not receiver_golden_state.initialized() or *it != receiver_golden_state.get() ) ) {
               encoders.erase( *it );
+              golden_states.erase( *it );
             }
 
             it++;
@@ -382,6 +435,27 @@ int main( int argc, char *argv[] )
 
       uint32_t selected_source_hash = initial_state;
 
+      /* the newest state the receiver is sure to have and that we can still
+         encode from. the receiver always keeps its golden state around, so
+         this is only the initial state until the first golden refresh is
+         acknowledged */
+      auto recovery_state =
+        [&]() -> uint32_t
+        {
+          for ( auto it = receiver_complete_states.crbegin();
+                it != receiver_complete_states.crend(); it++ ) {
+            if ( encoders.count( *it ) ) {
+              return *it;
+            }
+          }
+
+          if ( receiver_golden_state.initialized() ) {
+            return receiver_golden_state.get();
+          }
+
+          return initial_state;
+        };
+
       /* reason about the state of the receiver based on ack messages
        * this is the logic that decides which encoder to use. for example,
        * if the packet loss is huge, we can always select an encoder with a sure
@@ -390,15 +464,7 @@ int main( int argc, char *argv[] )
       /* if we're in 'conservative' mode, let's just encode based on something
          we're sure that is available in the receiver */
       if ( system_clock::now() < conservative_until ) {
-        if( receiver_complete_states.size() == 0 ) {
-          /* and the receiver doesn't have any other states, other than the
-             default state */
-          selected_source_hash = initial_state;
-        }
-        else {
-          /* the receiver has at least one stored state, let's use it */
-          selected_source_hash = receiver_complete_states.back();
-        }
+        selected_source_hash = recovery_state();
       }
       else if ( not receiver_last_acked_state.initialized() ) {
         /* okay, we're not in 'conservative' mode */
@@ -423,15 +489,7 @@ int main( int argc, char *argv[] )
           cerr << "Going into 'conservative' mode for next "
                << conservative_for.count() << " seconds." << endl;
 
-          if( receiver_complete_states.size() == 0 ) {
-            /* and the receiver doesn't have any other states, other than the
-               default state */
-            selected_source_hash = initial_state;
-          }
-          else {
-            /* the receiver has at least one stored state, let's use it */
-            selected_source_hash = receiver_complete_states.back();
-          }
+          selected_source_hash = recovery_state();
         }
         else {
           /* we assume that the receiver is in a right state */
@@ -496,13 +554,44 @@ int main( int argc, char *argv[] )
                                   increment_quantizer( last_quantizer, +23 ), 0 );
       }
 
+      /* is it time to refresh the golden frame? only base-layer frames
+         refresh it, so an upper-layer frame leaves it for the next one */
+      refreshing_golden = ( selected_source_hash != initial_state and
+                            encoder.temporal_layer() == 0 and
+                            next_golden_refresh <= system_clock::now() );
+
+      if ( refreshing_golden ) {
+        for ( auto & job : encode_jobs ) {
+          job.encoder.set_refresh_golden( true );
+        }
+      }
+
       // this thread will spawn all the encoding jobs and will wait on the results
       thread(
-        [&encode_jobs, &encode_outputs, &encode_end_pipe, operation_mode]()
+        [&encode_jobs, &encode_outputs, &encode_end_pipe, operation_mode, analyze_once]()
         {
           encode_outputs.clear();
           encode_outputs.reserve( encode_jobs.size() );
 
+          /* the jobs differ only in their quantizers, so they can share one
+             mode decision, made halfway between them */
+          if ( analyze_once and encode_jobs.size() > 1 ) {
+            Encoder analyzer = encode_jobs.front().encoder;
+            unsigned int y_ac_qi_sum = 0;
+
+            for ( const auto & job : encode_jobs ) {
+              y_ac_qi_sum += job.y_ac_qi;
+            }
+
+            const auto analysis = make_shared<const Optional<InterFrameHandle>>(
+              analyzer.analyze_frame( encode_jobs.front().raster.get(),
+                                      y_ac_qi_sum / encode_jobs.size() ) );
+
+            for ( auto & job : encode_jobs ) {
+              job.analysis = analysis;
+            }
+          }
+
           for ( auto & job : encode_jobs ) {
             encode_outputs.push_back(
               async( ( ( operation_mode == OperationMode::S2 ) ? launch::async : launch::deferred ),
@@ -645,6 +734,12 @@ int main( int argc, char *argv[] )
       /* now we assume that the receiver will successfully get this */
       receiver_assumed_state.reset( target_minihash );
 
+      if ( refreshing_golden ) {
+        /* this becomes the receiver's golden state once it's acknowledged */
+        golden_states.insert( target_minihash );
+        next_golden_refresh = last_sent + golden_refresh_interval;
+      }
+
       encoders.insert( make_pair( target_minihash, move( output.encoder ) ) );
       encoder_states.push_back( target_minihash );
 
@@ -680,6 +775,24 @@ int main( int argc, char *argv[] )
       receiver_last_acked_state.reset( ack.current_state() );
       receiver_complete_states = move( ack.complete_states() );
 
+      /* has the receiver got a newer golden state? */
+      for ( auto it = receiver_complete_states.crbegin();
+            it != receiver_complete_states.crend(); it++ ) {
+        if ( golden_states.count( *it ) and encoders.count( *it ) ) {
+          if ( receiver_golden_state.initialized() and
+               receiver_golden_state.get() != *it and
+               find( encoder_states.begin(), encoder_states.end(),
+                     receiver_golden_state.get() ) == encoder_states.end() ) {
+            /* the old golden state was only kept for recovery */
+            encoders.erase( receiver_golden_state.get() );
+            golden_states.erase( receiver_golden_state.get() );
+          }
+
+          receiver_golden_state.reset( *it );
+          break;
+        }
+      }
+
       return ResultType::Continue;
     } )
   );
@@ -0,0 +1,145 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "config.h"
+#include "exception.hh"
+
+using namespace std;
+
+#ifdef HAVE_SSE2
+
+#include "satd_sse2.cc"
+
+/* the sum of the absolute values of the (unnormalized) 4x4 Walsh-Hadamard
+   transform of each 4x4 block of the difference, written out plainly */
+uint32_t reference_satd( const unsigned int size,
+                         const uint8_t * src, const int src_stride,
+                         const uint8_t * ref, const int ref_stride )
+{
+  uint32_t sum = 0;
+
+  for ( unsigned int block_row = 0; block_row < size; block_row += 4 ) {
+    for ( unsigned int block_column = 0; block_column < size; block_column += 4 ) {
+      static constexpr int hadamard[ 4 ][ 4 ] = { {  1,  1,  1,  1 },
+                                                  {  1, -1,  1, -1 },
+                                                  {  1,  1, -1, -1 },
+                                                  {  1, -1, -1,  1 } };
+
+      int diff[ 4 ][ 4 ];
+      for ( unsigned int i = 0; i < 4; i++ ) {
+        for ( unsigned int j = 0; j < 4; j++ ) {
+          const unsigned int src_index = ( block_row + i ) * src_stride + block_column + j;
+          const unsigned int ref_index = ( block_row + i ) * ref_stride + block_column + j;
+          diff[ i ][ j ] = src[ src_index ] - ref[ ref_index ];
+        }
+      }
+
+      /* H * diff * H, one coefficient at a time */
+      for ( unsigned int u = 0; u < 4; u++ ) {
+        for ( unsigned int v = 0; v < 4; v++ ) {
+          int coefficient = 0;
+
+          for ( unsigned int i = 0; i < 4; i++ ) {
+            for ( unsigned int j = 0; j < 4; j++ ) {
+              coefficient += hadamard[ u ][ i ] * diff[ i ][ j ] * hadamard[ j ][ v ];
+            }
+          }
+
+          sum += abs( coefficient );
+        }
+      }
+    }
+  }
+
+  return sum;
+}
+
+#endif
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc != 1 ) {
+      cerr << "Usage: " << argv[ 0 ] << endl;
+      return EXIT_FAILURE;
+    }
+
+#ifdef HAVE_SSE2
+    random_device rd;
+    default_random_engine gen( rd() );
+    uniform_int_distribution<uint16_t> pixels( 0, 255 );
+    uniform_int_distribution<int> strides( 16, 64 );
+    bernoulli_distribution coin;
+
+    typedef uint32_t ( *SATDKernel )( const uint8_t *, int, const uint8_t *, int );
+    const vector<pair<unsigned int, SATDKernel>> kernels = { { 4, satd4x4_sse2 },
+                                                             { 8, satd8x8_sse2 },
+                                                             { 16, satd16x16_sse2 } };
+
+    for ( unsigned int trial = 0; trial < 1000; trial++ ) {
+      const int src_stride = strides( gen );
+      const int ref_stride = strides( gen );
+
+      /* the extremes (all 0 against all 255) give the largest transforms */
+      const bool extreme = trial < 2;
+
+      vector<uint8_t> src( 16 * src_stride ), ref( 16 * ref_stride );
+
+      for ( uint8_t & pixel : src ) {
+        pixel = extreme ? 255 * trial : pixels( gen );
+      }
+
+      for ( uint8_t & pixel : ref ) {
+        pixel = extreme ? 255 * ( 1 - trial ) : coin( gen ) ? pixels( gen ) : 128;
+      }
+
+      for ( const auto & kernel : kernels ) {
+        const uint32_t expected = reference_satd( kernel.first, src.data(), src_stride,
+                                                  ref.data(), ref_stride );
+        const uint32_t actual = kernel.second( src.data(), src_stride, ref.data(), ref_stride );
+
+        if ( actual != expected ) {
+          throw runtime_error( to_string( kernel.first ) + "x" + to_string( kernel.first )
+                               + " SATD is " + to_string( actual ) + ", expected "
+                               + to_string( expected ) );
+        }
+      }
+    }
+#endif
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
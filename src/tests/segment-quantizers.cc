@@ -0,0 +1,107 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <iostream>
+
+#include "ivf.hh"
+#include "decoder.hh"
+#include "frame.hh"
+
+using namespace std;
+
+/* decodes a frame and prints its quantizer index, then the quantizer index
+   and the number of macroblocks of each segment */
+template<class FrameType>
+void print_segments( Decoder & decoder, const UncompressedChunk & decompressed_frame )
+{
+  const FrameType frame = decoder.parse_frame<FrameType>( decompressed_frame );
+  decoder.decode_frame( frame );
+
+  const int y_ac_qi = frame.header().quant_indices.y_ac_qi;
+  cout << y_ac_qi;
+
+  const DecoderState state = decoder.get_state();
+
+  if ( not state.segmentation.initialized() ) {
+    cout << endl;
+    return;
+  }
+
+  const Segmentation & segmentation = state.segmentation.get();
+
+  /* the map has room for a segment per pixel; only the macroblocks' count */
+  const unsigned int mb_columns = ( decoder.get_width() + 15 ) / 16;
+  const unsigned int mb_rows = ( decoder.get_height() + 15 ) / 16;
+
+  SafeArray<unsigned int, num_segments> counts {{}};
+
+  for ( unsigned int mb_row = 0; mb_row < mb_rows; mb_row++ ) {
+    for ( unsigned int mb_column = 0; mb_column < mb_columns; mb_column++ ) {
+      counts.at( segmentation.map.at( mb_column, mb_row ) )++;
+    }
+  }
+
+  for ( uint8_t i = 0; i < num_segments; i++ ) {
+    const int adjustment = segmentation.segment_quantizer_adjustments.at( i );
+    const int segment_qi = segmentation.absolute_segment_adjustments
+                           ? adjustment : y_ac_qi + adjustment;
+
+    cout << " " << max( 0, min( 127, segment_qi ) ) << " " << counts.at( i );
+  }
+
+  cout << endl;
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc != 2 ) {
+      cerr << "Usage: " << argv[ 0 ] << " FILENAME" << endl;
+      return EXIT_FAILURE;
+    }
+
+    const IVF file( argv[ 1 ] );
+    Decoder decoder( file.width(), file.height() );
+
+    for ( uint32_t i = 0; i < file.frame_count(); i++ ) {
+      const UncompressedChunk decompressed_frame = decoder.decompress_frame( file.frame( i ) );
+
+      if ( decompressed_frame.key_frame() ) {
+        print_segments<KeyFrame>( decoder, decompressed_frame );
+      }
+      else {
+        print_segments<InterFrame>( decoder, decompressed_frame );
+      }
+    }
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
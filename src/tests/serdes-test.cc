@@ -65,6 +65,9 @@ Encoder random_encoder(default_random_engine &rng);
 
 template<typename T> void run_one_test(T (*gen)(default_random_engine &), default_random_engine &rng, string tname);
 
+void run_raster_offset_test(default_random_engine &rng, unsigned padding);
+void run_old_format_test(void);
+
 int main( int argc, char *argv[] ) {
   unsigned num_tests = 16;
   if (argc > 1) {
@@ -119,6 +122,19 @@ int main( int argc, char *argv[] ) {
       run_one_test(random_decoder, rng, "Decoder");
     }
 
+    // raster records whose planes need no, a little, and almost a
+    // page of padding to start at an aligned offset
+    cout << "\nRasterOffsets:     " << flush;
+    for (unsigned padding : {0u, 1u, 4095u, 4080u}) {
+      cout << '.' << flush;
+      run_raster_offset_test(rng, padding);
+    }
+
+    // files without the format version
+    cout << "\nOldFormat:         " << flush;
+    run_old_format_test();
+    cout << '.';
+
     cout << '\n';
   } catch ( const exception & e ) {
     print_exception( argv[ 0 ], e );
@@ -149,6 +165,63 @@ void run_one_test(T (*gen)(default_random_engine &), default_random_engine &rng,
   }
 }
 
+void run_raster_offset_test(default_random_engine &rng, unsigned padding) {
+  // the format header, the References header, and the raster's tag and
+  // length come before the padding
+  const size_t record_offset = SERDES_FORMAT_HEADER_SIZE + 9 + 5;
+  const size_t filler = (2 * SERDES_PLANE_ALIGNMENT - record_offset - padding) % SERDES_PLANE_ALIGNMENT;
+
+  EncoderStateSerializer odata = {};
+  for (size_t i = 0; i < filler; i++) {
+    odata.put((uint8_t) i);
+  }
+
+  References _in = random_references(rng);
+  _in.serialize(odata);
+
+  EncoderStateDeserializer idata = deser_from_ser(move(odata));
+  for (size_t i = 0; i < filler; i++) {
+    if (idata.get<uint8_t>() != (uint8_t) i) {
+      throw runtime_error("RasterOffsets failed: filler does not match");
+    }
+  }
+
+  References _out = References::deserialize(idata);
+
+  const unsigned width = _in.last.get().width();
+  const unsigned height = _in.last.get().height();
+  const size_t planes_len = width * height + 2 * (width / 2) * (height / 2);
+
+  if (!(_in == _out) or idata.remaining() != 0
+      or idata.size() != record_offset + filler + padding + planes_len) {
+    throw runtime_error("RasterOffsets failed: _in and _out do not match");
+  }
+}
+
+void run_old_format_test(void) {
+  // a Decoder as written before the format version: its tag comes first
+  const uint8_t old_data[] = { (uint8_t) EncoderSerDesTag::DECODER, 0, 0, 0, 0 };
+  const uint8_t other_version[] = { (uint8_t) EncoderSerDesTag::FORMAT_VERSION, SERDES_FORMAT_VERSION + 1 };
+
+  for (const auto &data : { make_pair(old_data, sizeof(old_data)),
+                            make_pair(other_version, sizeof(other_version)) }) {
+    FILE *f = tmpfile();
+    fwrite(data.first, 1, data.second, f);
+    fflush(f);
+
+    bool rejected = false;
+    try {
+      EncoderStateDeserializer idata(f);
+    } catch (const runtime_error &) {
+      rejected = true;
+    }
+
+    if (!rejected) {
+      throw runtime_error("OldFormat failed: state file accepted");
+    }
+  }
+}
+
 EncoderStateDeserializer deser_from_ser(EncoderStateSerializer &&odata) {
   FILE *f = tmpfile();
   odata.write(f);
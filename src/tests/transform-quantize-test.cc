@@ -0,0 +1,197 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <iostream>
+#include <random>
+#include <utility>
+
+#include "block.hh"
+#include "raster_handle.hh"
+#include "exception.hh"
+
+using namespace std;
+
+#ifdef HAVE_SSE2
+
+#include "transform_quantize_sse2.cc"
+
+/* the scalar path: residual, forward DCT, then (if there are factors)
+   quantization, one subblock at a time */
+template<unsigned int count>
+void scalar_subtract_dct_quantize( const SafeArray<VP8Raster::Block4, count> & original,
+                                   const SafeArray<VP8Raster::Block4, count> & prediction,
+                                   const pair<uint16_t, uint16_t> & factors,
+                                   const bool walsh,
+                                   SafeArray<DCTCoefficients, count> & coefficients,
+                                   SafeArray<int16_t, count> & walsh_input )
+{
+  for ( unsigned int i = 0; i < count; i++ ) {
+    coefficients.at( i ).subtract_dct( original.at( i ), prediction.at( i ).contents() );
+
+    if ( walsh ) {
+      walsh_input.at( i ) = coefficients.at( i ).at( 0 );
+      coefficients.at( i ).set_dc_coefficient( 0 );
+    }
+
+    if ( factors.second > 0 ) {
+      coefficients.at( i ) = coefficients.at( i ).quantize( factors );
+    }
+  }
+}
+
+/* the fused path, as Encoder::luma_mb_subtract_dct_quantize and
+   Encoder::chroma_mb_subtract_dct_quantize run it over a plane */
+template<unsigned int size, unsigned int count>
+void fused_subtract_dct_quantize( const VP8Raster::Block<size * 4> & original,
+                                  const VP8Raster::Block<size * 4> & prediction,
+                                  const pair<uint16_t, uint16_t> & factors,
+                                  const bool walsh,
+                                  SafeArray<DCTCoefficients, count> & coefficients,
+                                  SafeArray<int16_t, count> & walsh_input )
+{
+  for ( unsigned int row = 0; row < size; row++ ) {
+    for ( unsigned int column = 0; column < size; column += 2 ) {
+      subtract_dct_quantize_4x4x2_sse2( &original.at( 4 * column, 4 * row ), original.stride(),
+                                        &prediction.at( 4 * column, 4 * row ), prediction.stride(),
+                                        factors.first, factors.second,
+                                        walsh ? &walsh_input.at( row * size + column ) : nullptr,
+                                        &coefficients.at( row * size + column ).at( 0 ),
+                                        &coefficients.at( row * size + column + 1 ).at( 0 ) );
+    }
+  }
+}
+
+template<unsigned int size, unsigned int count>
+void compare( const VP8Raster::Block<size * 4> & original,
+              const VP8Raster::Block<size * 4> & prediction,
+              const SafeArray<VP8Raster::Block4, count> & original_sub,
+              const SafeArray<VP8Raster::Block4, count> & prediction_sub,
+              const pair<uint16_t, uint16_t> & factors, const bool walsh )
+{
+  SafeArray<DCTCoefficients, count> expected, actual;
+  SafeArray<int16_t, count> expected_walsh {{}}, actual_walsh {{}};
+
+  scalar_subtract_dct_quantize( original_sub, prediction_sub, factors, walsh,
+                                expected, expected_walsh );
+  fused_subtract_dct_quantize<size>( original, prediction, factors, walsh,
+                                     actual, actual_walsh );
+
+  for ( unsigned int i = 0; i < count; i++ ) {
+    for ( unsigned int j = 0; j < 16; j++ ) {
+      if ( actual.at( i ).at( j ) != expected.at( i ).at( j ) ) {
+        throw runtime_error( "subblock " + to_string( i ) + ", coefficient " + to_string( j )
+                             + " with factors " + to_string( factors.first ) + "/"
+                             + to_string( factors.second ) + ": got "
+                             + to_string( actual.at( i ).at( j ) ) + ", expected "
+                             + to_string( expected.at( i ).at( j ) ) );
+      }
+    }
+
+    if ( actual_walsh.at( i ) != expected_walsh.at( i ) ) {
+      throw runtime_error( "subblock " + to_string( i ) + ": DC for Y2 is "
+                           + to_string( actual_walsh.at( i ) ) + ", expected "
+                           + to_string( expected_walsh.at( i ) ) );
+    }
+  }
+}
+
+#endif
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc != 1 ) {
+      cerr << "Usage: " << argv[ 0 ] << endl;
+      return EXIT_FAILURE;
+    }
+
+#ifdef HAVE_SSE2
+    random_device rd;
+    default_random_engine gen( rd() );
+    uniform_int_distribution<uint16_t> pixels( 0, 255 );
+    uniform_int_distribution<int> noise( -24, 24 );
+    uniform_int_distribution<uint16_t> dc_factors( 4, 314 );
+    uniform_int_distribution<uint16_t> ac_factors( 4, 284 );
+    bernoulli_distribution coin;
+
+    const uint16_t width = 64, height = 48;
+    MutableRasterHandle original_handle { width, height }, prediction_handle { width, height };
+    VP8Raster & original = original_handle.get();
+    VP8Raster & prediction = prediction_handle.get();
+
+    for ( unsigned int trial = 0; trial < 200; trial++ ) {
+      /* either unrelated pictures (the largest residuals) or a prediction
+         close to the original (the usual case) */
+      const bool close = coin( gen );
+
+      auto fill = [&] ( TwoD<uint8_t> & original_plane, TwoD<uint8_t> & prediction_plane )
+        {
+          original_plane.forall_ij(
+            [&] ( uint8_t & pixel, const unsigned int column, const unsigned int row )
+            {
+              pixel = pixels( gen );
+              prediction_plane.at( column, row ) =
+                close ? max( 0, min( 255, pixel + noise( gen ) ) ) : pixels( gen );
+            }
+          );
+        };
+
+      fill( original.Y(), prediction.Y() );
+      fill( original.U(), prediction.U() );
+      fill( original.V(), prediction.V() );
+
+      /* no factors leaves the coefficients unquantized (for trellis
+         quantization) */
+      const pair<uint16_t, uint16_t> factors = coin( gen )
+        ? make_pair( dc_factors( gen ), ac_factors( gen ) )
+        : make_pair<uint16_t, uint16_t>( 0, 0 );
+
+      for ( unsigned int row = 0; row < height / 16; row++ ) {
+        for ( unsigned int column = 0; column < width / 16; column++ ) {
+          const VP8Raster::Macroblock original_mb = original.macroblock( column, row );
+          const VP8Raster::Macroblock prediction_mb = prediction.macroblock( column, row );
+
+          compare<4>( original_mb.Y, prediction_mb.Y, original_mb.Y_sub, prediction_mb.Y_sub,
+                      factors, false );
+          compare<4>( original_mb.Y, prediction_mb.Y, original_mb.Y_sub, prediction_mb.Y_sub,
+                      factors, true );
+          compare<2>( original_mb.U, prediction_mb.U, original_mb.U_sub, prediction_mb.U_sub,
+                      factors, false );
+          compare<2>( original_mb.V, prediction_mb.V, original_mb.V_sub, prediction_mb.V_sub,
+                      factors, false );
+        }
+      }
+    }
+#endif
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
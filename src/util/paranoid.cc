@@ -44,3 +44,17 @@ unsigned int paranoid::stoul( const std::string & in )
 
   return ret;
 }
+
+unsigned long paranoid::parse_bounded( const std::string & in, const std::string & name,
+                                       const unsigned long min_value,
+                                       const unsigned long max_value )
+{
+  const unsigned long value = std::stoul( in );
+
+  if ( value < min_value or value > max_value ) {
+    throw std::runtime_error( name + " must be between " + std::to_string( min_value )
+                              + " and " + std::to_string( max_value ) );
+  }
+
+  return value;
+}
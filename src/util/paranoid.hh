@@ -34,6 +34,12 @@
 namespace paranoid
 {
   unsigned int stoul( const std::string & in );
+
+  /* a value for an option kept in a narrow type, rejected when it's out of
+     range instead of wrapping around */
+  unsigned long parse_bounded( const std::string & in, const std::string & name,
+                               const unsigned long min_value,
+                               const unsigned long max_value );
 }
 
 
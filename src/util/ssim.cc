@@ -1,71 +1,247 @@
 /* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
 
-/* Based on (and linked with) libx264 (GPL-2+) */
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <algorithm>
+#include <thread>
+
+#include "config.h"
+#include "ssim.hh"
 
-/* Copyright (C) 2015-2018 the Alfalfa authors
+#ifdef HAVE_SSE2
+#include <emmintrin.h>
+#endif
 
-   This program is free software; you can redistribute it and/or
-   modify it under the terms of the GNU General Public License
-   as published by the Free Software Foundation; either version 2
-   of the License, or (at your option) any later version.
+using namespace std;
 
-   This program is distributed in the hope that it will be useful,
-   but WITHOUT ANY WARRANTY; without even the implied warranty of
-   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-   GNU General Public License for more details.
+namespace {
 
-   You should have received a copy of the GNU General Public License
-   along with this program; if not, write to the Free Software
-   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
-   02110-1301, USA. */
+/* integer constants for 8x8 windows of 8-bit samples, scaled so that
+   the per-window statistics never leave the int range */
+const int ssim_c1 = static_cast<int>( .01 * .01 * 255 * 255 * 64 + .5 );
+const int ssim_c2 = static_cast<int>( .03 * .03 * 255 * 255 * 64 * 63 + .5 );
 
-#include <cstdint>
-#include <vector>
-#include <x264.h>
+struct BlockSums
+{
+  int s1, s2, ss, s12;
+};
 
-#include "ssim.hh"
+void block_sums_4x4( const uint8_t * a, const uint8_t * b,
+                     const unsigned int stride, BlockSums & out )
+{
+  out = { 0, 0, 0, 0 };
+
+  for ( unsigned int y = 0; y < 4; y++ ) {
+    for ( unsigned int x = 0; x < 4; x++ ) {
+      const int pa = a[ y * stride + x ];
+      const int pb = b[ y * stride + x ];
+      out.s1 += pa;
+      out.s2 += pb;
+      out.ss += pa * pa + pb * pb;
+      out.s12 += pa * pb;
+    }
+  }
+}
 
-struct x264_pixel_function_t
+#ifdef HAVE_SSE2
+/* two horizontally adjacent 4x4 blocks at once, one in each half of the
+   registers */
+void block_sums_4x4x2( const uint8_t * a, const uint8_t * b,
+                       const unsigned int stride, BlockSums out[ 2 ] )
 {
-  // 158 is the number of pointers in this internal x264 struct
-  // this is obviously a bit fragile since x264 could add more
-  void * ptrs[ 158 ];
-};
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16( 1 );
+
+  __m128i s1 = zero, s2 = zero, ss = zero, s12 = zero;
+
+  for ( unsigned int y = 0; y < 4; y++ ) {
+    const __m128i pa = _mm_unpacklo_epi8(
+      _mm_loadl_epi64( reinterpret_cast<const __m128i *>( a + y * stride ) ), zero );
+    const __m128i pb = _mm_unpacklo_epi8(
+      _mm_loadl_epi64( reinterpret_cast<const __m128i *>( b + y * stride ) ), zero );
+
+    s1 = _mm_add_epi32( s1, _mm_madd_epi16( pa, ones ) );
+    s2 = _mm_add_epi32( s2, _mm_madd_epi16( pb, ones ) );
+    ss = _mm_add_epi32( ss, _mm_add_epi32( _mm_madd_epi16( pa, pa ),
+                                           _mm_madd_epi16( pb, pb ) ) );
+    s12 = _mm_add_epi32( s12, _mm_madd_epi16( pa, pb ) );
+  }
+
+  /* fold lanes 1 and 3 into lanes 0 and 2 */
+  alignas( 16 ) int r[ 4 ][ 4 ];
+  _mm_store_si128( reinterpret_cast<__m128i *>( r[ 0 ] ), _mm_add_epi32( s1, _mm_srli_epi64( s1, 32 ) ) );
+  _mm_store_si128( reinterpret_cast<__m128i *>( r[ 1 ] ), _mm_add_epi32( s2, _mm_srli_epi64( s2, 32 ) ) );
+  _mm_store_si128( reinterpret_cast<__m128i *>( r[ 2 ] ), _mm_add_epi32( ss, _mm_srli_epi64( ss, 32 ) ) );
+  _mm_store_si128( reinterpret_cast<__m128i *>( r[ 3 ] ), _mm_add_epi32( s12, _mm_srli_epi64( s12, 32 ) ) );
+
+  for ( unsigned int i = 0; i < 2; i++ ) {
+    out[ i ] = { r[ 0 ][ 2 * i ], r[ 1 ][ 2 * i ], r[ 2 ][ 2 * i ], r[ 3 ][ 2 * i ] };
+  }
+}
+#endif
 
-// These are internal libx264 instructions so they aren't included in x264.h
-extern "C"
+void block_sums_row( const uint8_t * a, const uint8_t * b, const unsigned int stride,
+                     const unsigned int count, BlockSums * out )
 {
-  float x264_8_pixel_ssim_wxh( const x264_pixel_function_t * func, const uint8_t *pix1,
-                             uintptr_t stride1, const uint8_t *pix2, uintptr_t stride2,
-                             int width, int height, void *buf, int *cnt );
+  unsigned int i = 0;
 
-  void x264_8_pixel_init( int cpu, x264_pixel_function_t *pixf );
+#ifdef HAVE_SSE2
+  for ( ; i + 1 < count; i += 2 ) {
+    block_sums_4x4x2( a + 4 * i, b + 4 * i, stride, out + i );
+  }
+#endif
 
-  uint32_t x264_cpu_detect( void );
+  for ( ; i < count; i++ ) {
+    block_sums_4x4( a + 4 * i, b + 4 * i, stride, out[ i ] );
+  }
 }
 
-x264_pixel_function_t init_pixel_function( void )
+/* SSIM of the 8x8 window made of four 4x4 blocks */
+double window_ssim( const BlockSums & b0, const BlockSums & b1,
+                    const BlockSums & b2, const BlockSums & b3 )
 {
-  x264_pixel_function_t pix_func;
-  x264_8_pixel_init( x264_cpu_detect(), &pix_func );
+  const int s1 = b0.s1 + b1.s1 + b2.s1 + b3.s1;
+  const int s2 = b0.s2 + b1.s2 + b2.s2 + b3.s2;
+  const int ss = b0.ss + b1.ss + b2.ss + b3.ss;
+  const int s12 = b0.s12 + b1.s12 + b2.s12 + b3.s12;
+
+  const int vars = ss * 64 - s1 * s1 - s2 * s2;
+  const int covar = s12 * 64 - s1 * s2;
+
+  return ( static_cast<double>( 2 * s1 * s2 + ssim_c1 ) * ( 2 * covar + ssim_c2 ) )
+         / ( static_cast<double>( s1 * s1 + s2 * s2 + ssim_c1 ) * ( vars + ssim_c2 ) );
+}
 
-  return pix_func;
 }
 
-x264_pixel_function_t x264_funcs = init_pixel_function();
+SSIMMap::SSIMMap( const unsigned int columns, const unsigned int rows )
+  : columns_( columns ), rows_( rows ),
+    sums_( columns * rows, 0.0 ), counts_( columns * rows, 0 )
+{}
+
+double SSIMMap::macroblock( const unsigned int column, const unsigned int row ) const
+{
+  const unsigned int i = row * columns_ + column;
+  return counts_.at( i ) ? sums_[ i ] / counts_[ i ] : 1.0;
+}
+
+double SSIMMap::row( const unsigned int row ) const
+{
+  double sum = 0.0;
+  unsigned int count = 0;
+
+  for ( unsigned int i = row * columns_; i < ( row + 1 ) * columns_; i++ ) {
+    sum += sums_.at( i );
+    count += counts_[ i ];
+  }
+
+  return count ? sum / count : 1.0;
+}
+
+double SSIMMap::score() const
+{
+  double sum = 0.0;
+  unsigned int count = 0;
+
+  for ( unsigned int i = 0; i < sums_.size(); i++ ) {
+    sum += sums_[ i ];
+    count += counts_[ i ];
+  }
+
+  return count ? sum / count : 1.0;
+}
+
+SSIMMap ssim_map( const TwoD<uint8_t> & image, const TwoD<uint8_t> & other_image,
+                  const unsigned int threads )
+{
+  assert( image.width() == other_image.width() and image.height() == other_image.height() );
+
+  const unsigned int stride = image.width();
+  const unsigned int blocks_x = image.width() / 4;
+  const unsigned int blocks_y = image.height() / 4;
+  const unsigned int windows_x = blocks_x > 1 ? blocks_x - 1 : 0;
+  const unsigned int windows_y = blocks_y > 1 ? blocks_y - 1 : 0;
+
+  SSIMMap map { ( windows_x + 3 ) / 4, ( windows_y + 3 ) / 4 };
+
+  if ( windows_x == 0 or windows_y == 0 ) {
+    return map;
+  }
+
+  const uint8_t * a = &image.at( 0, 0 );
+  const uint8_t * b = &other_image.at( 0, 0 );
+
+  /* each band covers whole macroblock rows, so bands never share an
+     entry of the map */
+  auto band = [&]( const unsigned int first_row, const unsigned int last_row )
+    {
+      vector<BlockSums> above( blocks_x ), below( blocks_x );
+      const unsigned int last_window = min( 4 * last_row, windows_y );
+
+      block_sums_row( a + 16 * first_row * stride, b + 16 * first_row * stride,
+                      stride, blocks_x, above.data() );
+
+      for ( unsigned int y = 4 * first_row; y < last_window; y++ ) {
+        block_sums_row( a + 4 * ( y + 1 ) * stride, b + 4 * ( y + 1 ) * stride,
+                        stride, blocks_x, below.data() );
+
+        for ( unsigned int x = 0; x < windows_x; x++ ) {
+          const unsigned int i = ( y / 4 ) * map.columns_ + x / 4;
+          map.sums_[ i ] += window_ssim( above[ x ], above[ x + 1 ],
+                                         below[ x ], below[ x + 1 ] );
+          map.counts_[ i ]++;
+        }
+
+        swap( above, below );
+      }
+    };
+
+  const unsigned int bands = min( threads ? threads : max( thread::hardware_concurrency(), 1u ),
+                                  map.rows_ );
+
+  if ( bands <= 1 ) {
+    band( 0, map.rows_ );
+    return map;
+  }
+
+  vector<thread> workers;
+  for ( unsigned int i = 0; i < bands; i++ ) {
+    workers.emplace_back( band, i * map.rows_ / bands, ( i + 1 ) * map.rows_ / bands );
+  }
+
+  for ( auto & worker : workers ) {
+    worker.join();
+  }
+
+  return map;
+}
 
-double ssim( const TwoD<uint8_t> & image, const TwoD<uint8_t> & other_image )
+double ssim( const TwoD<uint8_t> & image, const TwoD<uint8_t> & other_image,
+             const unsigned int threads )
 {
-   int count;
-   std::vector<uint8_t> tmp_buffer;
-   // Buffer size calculation taken from x264
-   tmp_buffer.resize( 8 * ( image.width() / 4 + 3 ) * sizeof( int ) );
-
-   // No padding so stride = width
-   double ssim = x264_8_pixel_ssim_wxh( &x264_funcs, &image.at( 0, 0 ), image.width(),
-                                        &other_image.at( 0, 0 ), other_image.width(),
-                                        image.width(), image.height(),
-                                        tmp_buffer.data(), &count );
-
-   return ssim / count;
+  return ssim_map( image, other_image, threads ).score();
 }
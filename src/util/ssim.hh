@@ -26,6 +26,44 @@
    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+#ifndef SSIM_HH
+#define SSIM_HH
+
+#include <cstdint>
+#include <vector>
+
 #include "2d.hh"
 
-double ssim( const TwoD<uint8_t> & image, const TwoD<uint8_t> & other_image );
+/* SSIM is computed over 8x8 windows placed every 4 pixels. Each window
+   is credited to the 16x16 macroblock holding its top-left corner, so
+   the map can report local quality per macroblock or per macroblock row. */
+class SSIMMap
+{
+private:
+  unsigned int columns_, rows_;
+  std::vector<double> sums_;
+  std::vector<unsigned int> counts_;
+
+  friend SSIMMap ssim_map( const TwoD<uint8_t> &, const TwoD<uint8_t> &,
+                           const unsigned int );
+
+public:
+  SSIMMap( const unsigned int columns, const unsigned int rows );
+
+  unsigned int columns() const { return columns_; }
+  unsigned int rows() const { return rows_; }
+
+  double macroblock( const unsigned int column, const unsigned int row ) const;
+  double row( const unsigned int row ) const;
+  double score() const;
+};
+
+/* `threads` splits the image into bands of macroblock rows; 0 means
+   one band per hardware thread */
+SSIMMap ssim_map( const TwoD<uint8_t> & image, const TwoD<uint8_t> & other_image,
+                  const unsigned int threads = 1 );
+
+double ssim( const TwoD<uint8_t> & image, const TwoD<uint8_t> & other_image,
+             const unsigned int threads = 1 );
+
+#endif /* SSIM_HH */